@@ -0,0 +1,473 @@
+/*
+   Auriol Weather Station Aggregator
+
+   Compile: gcc -o auriol-aggregator auriol-aggregator.c -lmosquitto -lpthread
+   Usage:   auriol-aggregator [workers] [receivers]
+
+   Subscribes to the undecoded frames every station publishes on
+   weather/<station>/raw ("<time ms>: <raw>") and hands each one to a worker
+   thread picked by hashing the station name, so a station's frames are
+   always handled by the same worker and no locking is needed between them.
+
+   Receiving is parallel too: each receiver is its own broker connection
+   with its own network thread, sharing one subscription
+   ($share/AGG_SHARE_GROUP/..., mosquitto 1.6 or later) so the broker
+   splits the frames between them. Any receiver may queue for any worker.
+
+   Workers republish normalized readings in batches on weather/readings,
+   one line per reading:
+     <station>,<id>,<channel>,<time ms>,<temp>,<humidity>,<battery>
+
+   Scope: a worker decodes the frame fields, drops repeats of a frame it
+   already passed on within DEDUP_WINDOW (QoS 1 redeliveries, and stations
+   from before repeat suppression), and batches what's left. Readings are
+   not combined across stations or over time, that is left to whatever
+   subscribes to weather/readings.
+*/
+
+#include <stdio.h>   // printf()
+#include <stdint.h>  // uint*_t
+#include <stdlib.h>  // exit(), calloc()
+#include <string.h>  // str manip
+#include <unistd.h>  // sleep(), sysconf()
+#include <limits.h>  // INT_MAX
+#include <pthread.h> // Worker threads
+#include <sys/syscall.h>  // SYS_futex
+#include <linux/futex.h>  // FUTEX_WAIT, FUTEX_WAKE
+#include <mosquitto.h>
+#include "auriol-decode.h" // Frame layout
+
+#define MAX_WORKERS 64
+#define MAX_RECEIVERS 16
+#define AGG_SHARE_GROUP "auriol-aggregator"
+#define SHARD_QUEUE 4096     // Frames waiting per worker, power of 2
+#define STATION_NAME 32      // Longest station name kept, with the NUL
+#define STATIONS 1024        // Stations per worker, power of 2
+#define STATION_SENSORS 12   // Sensor/channel pairs remembered per station
+#define DEDUP_WINDOW 5000    // Milliseconds a repeated frame counts as a duplicate
+#define BATCH_MAX 64         // Readings per published batch
+#define BATCH_LINE 80        // Longest reading line, station name included
+#define BATCH_MSEC 1000      // Longest a reading waits in a batch
+#define TIME_SEC_MAX 100000000000LL   // Smaller stamps are seconds, year 5138
+#define TIME_MSEC_MAX (TIME_SEC_MAX * 1000)
+
+struct rawmsg {
+    char station[STATION_NAME];
+    char payload[32];
+};
+
+struct seen {
+    uint64_t raw;
+    int64_t time;
+};
+
+struct station {
+    char name[STATION_NAME];
+    struct seen seen[STATION_SENSORS];
+    int nseen;
+    uint64_t readings;
+};
+
+// A queued frame, seq says whose turn the slot is: tail + 1 once a
+// receiver has filled it for the worker, tail + SHARD_QUEUE once the
+// worker has freed it for the receivers' next lap
+struct rawslot {
+    uint32_t seq;
+    struct rawmsg msg;
+};
+
+struct shard {
+    pthread_t thread;
+    struct aggregator *agg;
+
+    // Any receiver produces, the worker alone consumes
+    struct rawslot ring[SHARD_QUEUE];
+    unsigned int head, tail; // Slots claimed by receivers, freed by the worker
+    uint32_t wake;     // Futex word, bumped when a sleeping worker is needed
+    uint32_t sleeping;
+
+    // Only ever touched by the worker
+    struct station stations[STATIONS];
+    char batch[BATCH_MAX * BATCH_LINE];
+    int batchlen, batchcount;
+    struct timespec batchstart;
+
+    // Counters, read by the main thread
+    uint64_t received, dropped, duplicates, malformed, readings, batches;
+};
+
+struct aggregator {
+    struct mosquitto *mqtt[MAX_RECEIVERS];
+    int nreceivers;
+    struct shard *shards;
+    int nworkers;
+    int running;
+};
+
+// FNV-1a, decides which worker owns a station
+static inline uint32_t station_hash(const char *name, int len) {
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Queue a frame for the station's worker, returns 0 if the worker is full.
+// Safe from any number of receiver threads at once.
+int agg_dispatch(struct aggregator *agg, const char *station, int stationlen,
+                 const void *payload, int payloadlen) {
+    struct shard *shard;
+    struct rawslot *slot;
+    struct rawmsg *msg;
+    unsigned int head;
+    int diff;
+
+    shard = &agg->shards[station_hash(station, stationlen) % agg->nworkers];
+
+    // Claim the slot at head, unless the worker hasn't freed it yet
+    head = __atomic_load_n(&shard->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &shard->ring[head & (SHARD_QUEUE - 1)];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - head);
+        if (diff < 0) {
+            __atomic_add_fetch(&shard->dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (diff == 0 &&
+            __atomic_compare_exchange_n(&shard->head, &head, head + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (diff > 0)
+            head = __atomic_load_n(&shard->head, __ATOMIC_RELAXED);
+    }
+
+    msg = &slot->msg;
+    if (stationlen >= STATION_NAME)
+        stationlen = STATION_NAME - 1;
+    memcpy(msg->station, station, stationlen);
+    msg->station[stationlen] = 0;
+    if (payloadlen >= sizeof(msg->payload))
+        payloadlen = sizeof(msg->payload) - 1;
+    memcpy(msg->payload, payload, payloadlen);
+    msg->payload[payloadlen] = 0;
+
+    // Only pay for the syscall if the worker has gone to sleep. Both this
+    // store and load are seq_cst, pairing with the worker's store of
+    // sleeping and load of the slot, so at least one side sees the other.
+    __atomic_store_n(&slot->seq, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shard->sleeping, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&shard->wake, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &shard->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 1;
+}
+
+void cb_connect(struct mosquitto *mqtt, void *obj, int code) {
+	struct aggregator *agg = obj;
+
+	printf("Connection status: %s\n", mosquitto_connack_string(code));
+	if (code) {
+		mosquitto_disconnect(mqtt);
+		return;
+	}
+	// Subscribe here so a reconnect picks the subscription back up
+	if (agg->nreceivers > 1)
+		mosquitto_subscribe(mqtt, NULL, "$share/" AGG_SHARE_GROUP "/weather/+/raw", 1);
+	else
+		mosquitto_subscribe(mqtt, NULL, "weather/+/raw", 1);
+}
+
+void cb_message(struct mosquitto *mqtt, void *obj,
+                const struct mosquitto_message *msg) {
+    struct aggregator *agg = obj;
+    const char *station, *end;
+
+    // weather/<station>/raw
+    station = strchr(msg->topic, '/');
+    if (!station)
+        return;
+    station++;
+    end = strchr(station, '/');
+    if (!end || end == station)
+        return;
+
+    agg_dispatch(agg, station, end - station, msg->payload, msg->payloadlen);
+}
+
+struct station *station_find(struct shard *shard, const char *name) {
+    uint32_t i = station_hash(name, strlen(name));
+    struct station *st;
+    int n;
+
+    // Open addressing, a full table folds extra stations into one slot
+    for (n = 0; n < STATIONS; n++, i++) {
+        st = &shard->stations[i & (STATIONS - 1)];
+        if (st->name[0] == 0)
+            strcpy(st->name, name);
+        if (strcmp(st->name, name) == 0)
+            return st;
+    }
+    return st;
+}
+
+// Returns 1 if the station already reported this frame recently
+int station_seen(struct station *st, union tempdata *u, int64_t time) {
+    struct seen *s, *oldest = &st->seen[0];
+    union tempdata prev;
+    int i;
+
+    for (i = 0; i < st->nseen; i++) {
+        s = &st->seen[i];
+        prev.raw = s->raw;
+        if (prev.var.sensor == u->var.sensor &&
+            prev.var.channel == u->var.channel)
+            break;
+        if (s->time < oldest->time)
+            oldest = s;
+    }
+
+    if (i < st->nseen) {
+        if (s->raw == u->raw && time - s->time < DEDUP_WINDOW)
+            return 1;
+    } else if (st->nseen < STATION_SENSORS) {
+        s = &st->seen[st->nseen++];
+    } else {
+        s = oldest;
+    }
+
+    s->raw = u->raw;
+    s->time = time;
+    return 0;
+}
+
+void batch_flush(struct shard *shard) {
+    struct aggregator *agg = shard->agg;
+    char mqtttopic[] = "weather/readings";
+    int ret;
+
+    if (shard->batchcount == 0)
+        return;
+
+    // Spread the workers' batches over the connections
+    ret = mosquitto_publish(agg->mqtt[(shard - agg->shards) % agg->nreceivers], NULL, mqtttopic,
+                            shard->batchlen, shard->batch, 1, false);
+    if (ret != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Couldn't publish: %s\n", mosquitto_strerror(ret));
+
+    shard->batches++;
+    shard->batchlen = 0;
+    shard->batchcount = 0;
+}
+
+void shard_process(struct shard *shard, struct rawmsg *msg) {
+    union tempdata u;
+    struct station *st;
+    char line[BATCH_LINE];
+    int64_t when;
+    char *end;
+    int len;
+
+    shard->received++;
+
+    // "<time>: <raw>"
+    when = strtoll(msg->payload, &end, 10);
+    if (end[0] != ':' || end[1] != ' ' || when <= 0 || when >= TIME_MSEC_MAX) {
+        shard->malformed++;
+        return;
+    }
+    // Stations from before millisecond stamps send seconds
+    if (when < TIME_SEC_MAX)
+        when *= 1000;
+    u.raw = strtoull(end + 2, &end, 10) & 0xFFFFFFFFFF;
+    if (*end) {
+        shard->malformed++;
+        return;
+    }
+
+    st = station_find(shard, msg->station);
+    if (station_seen(st, &u, when)) {
+        shard->duplicates++;
+        return;
+    }
+    st->readings++;
+    shard->readings++;
+
+    len = snprintf(line, sizeof(line), "%s,%02x,%u,%lld,%.1f,%u,%u\n",
+                   msg->station, u.var.sensor, u.var.channel + 1,
+                   (long long)when, ((float)u.var.celcius / 10),
+                   u.var.humidity, u.var.charge);
+    if (len >= sizeof(line))
+        len = sizeof(line) - 1; // Can't happen with the fields bounded above
+
+    // A batch only ever holds whole lines, send it if this one won't fit
+    if (len > sizeof(shard->batch) - shard->batchlen)
+        batch_flush(shard);
+    if (shard->batchcount == 0)
+        clock_gettime(CLOCK_MONOTONIC, &shard->batchstart);
+    memcpy(shard->batch + shard->batchlen, line, len);
+    shard->batchlen += len;
+    if (++shard->batchcount == BATCH_MAX)
+        batch_flush(shard);
+}
+
+// The worker's next slot, if a receiver has filled it
+static inline struct rawslot *shard_next(struct shard *shard, int memorder) {
+    struct rawslot *slot = &shard->ring[shard->tail & (SHARD_QUEUE - 1)];
+
+    return __atomic_load_n(&slot->seq, memorder) == shard->tail + 1 ? slot : NULL;
+}
+
+void *shard_worker(void *arg) {
+    struct shard *shard = arg;
+    struct timespec now, gap, timeout = { 0, BATCH_MSEC * 1000000L };
+    struct rawslot *slot;
+    uint32_t wake;
+
+    for (;;) {
+        // Work through everything queued, handing each slot back as we go
+        while ((slot = shard_next(shard, __ATOMIC_ACQUIRE))) {
+            shard_process(shard, &slot->msg);
+            __atomic_store_n(&slot->seq, shard->tail + SHARD_QUEUE, __ATOMIC_RELEASE);
+            __atomic_store_n(&shard->tail, shard->tail + 1, __ATOMIC_RELAXED);
+        }
+
+        // Don't hold a partial batch back for too long
+        if (shard->batchcount) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timesecdiff(&shard->batchstart, &now, &gap);
+            if (gap.tv_sec * 1000 + gap.tv_nsec / 1000000 >= BATCH_MSEC)
+                batch_flush(shard);
+        }
+
+        if (!__atomic_load_n(&shard->agg->running, __ATOMIC_ACQUIRE) &&
+            !shard_next(shard, __ATOMIC_ACQUIRE))
+            break;
+
+        // Nothing queued, sleep until a receiver wakes us
+        // Seq_cst against agg_dispatch()'s store of seq and load of sleeping
+        wake = __atomic_load_n(&shard->wake, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!shard_next(shard, __ATOMIC_SEQ_CST))
+            syscall(SYS_futex, &shard->wake, FUTEX_WAIT, wake, &timeout, NULL, 0);
+        __atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELEASE);
+    }
+
+    batch_flush(shard);
+    return NULL;
+}
+
+void agg_start(struct aggregator *agg, int nworkers) {
+    int i, j;
+
+    agg->nworkers = nworkers;
+    agg->shards = calloc(nworkers, sizeof(*agg->shards));
+    if (!agg->shards) {
+        fprintf(stderr, "failure allocating workers\n");
+        exit(1);
+    }
+
+    agg->running = 1;
+    for (i = 0; i < nworkers; i++) {
+        agg->shards[i].agg = agg;
+        for (j = 0; j < SHARD_QUEUE; j++)
+            agg->shards[i].ring[j].seq = j;
+        if (pthread_create(&agg->shards[i].thread, NULL, shard_worker,
+                           &agg->shards[i]) != 0) {
+            fprintf(stderr, "failure starting worker\n");
+            exit(1);
+        }
+    }
+}
+
+// Let the workers drain what they have, then wait for them
+void agg_stop(struct aggregator *agg) {
+    int i;
+
+    __atomic_store_n(&agg->running, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < agg->nworkers; i++) {
+        __atomic_add_fetch(&agg->shards[i].wake, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &agg->shards[i].wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        pthread_join(agg->shards[i].thread, NULL);
+    }
+    free(agg->shards);
+}
+
+void agg_print_stats(struct aggregator *agg) {
+    uint64_t received = 0, dropped = 0, duplicates = 0, malformed = 0;
+    uint64_t readings = 0, batches = 0;
+    int i;
+
+    for (i = 0; i < agg->nworkers; i++) {
+        received += __atomic_load_n(&agg->shards[i].received, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&agg->shards[i].dropped, __ATOMIC_RELAXED);
+        duplicates += __atomic_load_n(&agg->shards[i].duplicates, __ATOMIC_RELAXED);
+        malformed += __atomic_load_n(&agg->shards[i].malformed, __ATOMIC_RELAXED);
+        readings += __atomic_load_n(&agg->shards[i].readings, __ATOMIC_RELAXED);
+        batches += __atomic_load_n(&agg->shards[i].batches, __ATOMIC_RELAXED);
+    }
+
+    printf("%ld: received=%llu,dropped=%llu,dup=%llu,bad=%llu,readings=%llu,batches=%llu\n",
+           time(NULL), (unsigned long long)received, (unsigned long long)dropped,
+           (unsigned long long)duplicates, (unsigned long long)malformed,
+           (unsigned long long)readings, (unsigned long long)batches);
+}
+
+void main(int argc, char **argv)
+{
+    static struct aggregator agg;
+    char mqtthost[] = "localhost";
+    int mqttport = 1883;
+    int mqtttimeout = 60;
+    int ret, nworkers, i;
+
+    nworkers = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    agg.nreceivers = argc > 2 ? atoi(argv[2]) : 1;
+    if (nworkers < 1 || nworkers > MAX_WORKERS ||
+        agg.nreceivers < 1 || agg.nreceivers > MAX_RECEIVERS) {
+        fprintf(stderr, "usage: %s [workers, 1-%d] [receivers, 1-%d]\n",
+                argv[0], MAX_WORKERS, MAX_RECEIVERS);
+        exit(1);
+    }
+    agg_start(&agg, nworkers);
+
+    mosquitto_lib_init();
+    for (i = 0; i < agg.nreceivers; i++) {
+        agg.mqtt[i] = mosquitto_new(NULL, true, &agg);
+        if(agg.mqtt[i] == NULL) {
+            fprintf(stderr, "Error initialising MQTT\n");
+            exit(1);
+        }
+
+        mosquitto_connect_callback_set(agg.mqtt[i], cb_connect);
+        mosquitto_message_callback_set(agg.mqtt[i], cb_message);
+
+        ret = mosquitto_connect(agg.mqtt[i], mqtthost, mqttport, mqtttimeout);
+        if (ret != MOSQ_ERR_SUCCESS) {
+            mosquitto_destroy(agg.mqtt[i]);
+            fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
+            exit(2);
+        }
+
+        ret = mosquitto_loop_start(agg.mqtt[i]);
+        if (ret != MOSQ_ERR_SUCCESS) {
+            mosquitto_destroy(agg.mqtt[i]);
+            fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
+            exit(2);
+        }
+    }
+
+    for(;;) {
+        sleep(60);
+        agg_print_stats(&agg);
+    }
+
+    // Clean up - should really use signals here
+    agg_stop(&agg);
+    for (i = 0; i < agg.nreceivers; i++)
+        mosquitto_destroy(agg.mqtt[i]);
+    mosquitto_lib_cleanup();
+}
@@ -0,0 +1,447 @@
+/*
+   Auriol Weather Station - frame layout and edge decoder
+
+   Shared by the station programs. The decoder is fed the kernel timestamp
+   of every rising edge on the receiver and hands back each 37-bit frame
+   that ends in a sync gap. See auriol-lcd-mqtt.c for the bit layout and
+   timings.
+
+   The gap between rising edges that counts as a 0, a 1 or a sync bit is
+   a window per symbol. The defaults suit most receivers; a calibration
+   run of tests/libgpiod-detect-rising-edge.c writes windows measured on
+   this receiver to PULSE_CONF, one symbol per line:
+     zero 1460000 1560000
+     one  2460000 2560000
+     sync 4460000 4560000
+   (gap in nanoseconds, from inclusive, to exclusive)
+
+   Cheap receivers put spikes on the line, often just after a real edge.
+   glitch_filter() drops any edge that comes sooner than pulse_windows.glitch
+   after the last edge it kept, so a spike doesn't reset a frame in
+   progress. The minimum can be set in PULSE_CONF too:
+     glitch 500000
+   libgpiod v1 has no way to ask the kernel to debounce the line, so the
+   spikes still cost a wakeup; the filter runs before classification.
+
+   Edges can be fed one at a time (decode_edge) or as a batch of flat
+   nanosecond timestamps (decode_batch). A batch is classified into
+   symbols in one branch-free pass, with AVX2 or SSE4.2 on x86 and NEON on
+   ARM when the compiler targets them (-mavx2, -msse4.2, -mfpu=neon), and
+   plain C otherwise. The bit assembler then walks the symbol array.
+*/
+
+#ifndef AURIOL_DECODE_H
+#define AURIOL_DECODE_H
+
+#include <stdio.h>  // fopen(), fgets()
+#include <stdint.h> // uint*_t
+#include <string.h> // memset(), strcmp()
+#include <time.h>   // struct timespec
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+struct var_s {
+    uint8_t coda : 4;
+    uint16_t humidity : 8; // Don't ask
+    uint8_t unknown : 4;
+    int16_t celcius : 12;
+    uint8_t channel : 2;
+    uint8_t manual : 1;
+    uint8_t charge : 1;
+    uint8_t sensor : 8;
+    uint32_t null : 24;
+}__attribute((__packed__));
+
+union tempdata {
+    struct var_s var;
+    uint64_t raw;
+};
+
+#define PULSE_CONF "/etc/auriol-pulse.conf"
+
+// Gaps in nanoseconds, min inclusive, max exclusive
+struct pulse_windows {
+    long zero_min, zero_max;
+    long one_min, one_max;
+    long sync_min, sync_max;
+    long glitch; // Edges closer than this to the last one are spikes, 0 = off
+};
+
+// Receiver-wide counters, frames can't be told apart until they decode
+struct decoder_stats {
+    uint64_t edges;         // Rising edges seen, glitches excluded
+    uint64_t glitches;      // Edges dropped by the glitch filter
+    uint64_t started;       // Frames that got at least one bit
+    uint64_t aborted_gap;   // Frames cut short by an out-of-spec gap
+    uint64_t aborted_count; // Frames ending in sync with bitcount != 37
+    uint64_t accepted;      // Frames of 37 bits ending in sync
+};
+
+// What each gap between rising edges means to the bit assembler
+enum {
+    SYM_RESET = 0,
+    SYM_ZERO,
+    SYM_ONE,
+    SYM_SYNC
+};
+
+#define DECODE_BATCH 64 // Edges classified per pass
+#define DECODE_FRAMES (DECODE_BATCH / 38 + 1) // Frames one batch can end
+
+struct decoder {
+    struct pulse_windows win;
+    int64_t last; // Previous edge, nsecs
+    uint64_t buf;
+    int bitcount;
+    struct decoder_stats stats;
+};
+
+// Used to calculate time difference
+static inline void timesecdiff(const struct timespec *old,
+                               const struct timespec *new,
+                               struct timespec *diff)
+{
+    diff->tv_sec = new->tv_sec - old->tv_sec;
+    diff->tv_nsec = new->tv_nsec - old->tv_nsec;
+    if (diff->tv_nsec < 0) {
+        diff->tv_nsec += 1000000000L;
+        diff->tv_sec--;
+    }
+}
+
+static inline void decoder_init(struct decoder *dec)
+{
+    memset(dec, 0, sizeof(*dec));
+
+    // 1.5, 2.5 and 4.5 msecs, give or take
+    dec->win.zero_min = 1460000;
+    dec->win.zero_max = 1560000;
+    dec->win.one_min = 2460000;
+    dec->win.one_max = 2560000;
+    dec->win.sync_min = 4460000;
+    dec->win.sync_max = 4560000;
+
+    // Far shorter than any symbol
+    dec->win.glitch = 500000;
+}
+
+// Read calibrated windows, returns -1 (leaving *win alone) if unusable
+static inline int pulse_windows_load(const char *path, struct pulse_windows *win)
+{
+    struct pulse_windows w = *win;
+    char line[128], name[16];
+    long min, max;
+    int found = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "glitch %ld", &min) == 1 && min >= 0) {
+            w.glitch = min;
+            continue;
+        }
+        if (sscanf(line, "%15s %ld %ld", name, &min, &max) != 3 ||
+            name[0] == '#' || min <= 0 || max <= min || max >= 1000000000L)
+            continue;
+        if (strcmp(name, "zero") == 0) {
+            w.zero_min = min;
+            w.zero_max = max;
+            found |= 1;
+        } else if (strcmp(name, "one") == 0) {
+            w.one_min = min;
+            w.one_max = max;
+            found |= 2;
+        } else if (strcmp(name, "sync") == 0) {
+            w.sync_min = min;
+            w.sync_max = max;
+            found |= 4;
+        }
+    }
+    fclose(f);
+
+    // All three or nothing, and they mustn't overlap
+    if (found != 7 || w.zero_max > w.one_min || w.one_max > w.sync_min ||
+        w.glitch >= w.zero_min)
+        return -1;
+
+    *win = w;
+    return 0;
+}
+
+static inline int64_t timespec_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static inline void ns_timespec(int64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+// Drop edges (nsecs) that come too soon after the last one kept, compacting
+// ts in place, returns how many are left. If mask isn't NULL, bit i is set
+// there for each edge kept (n up to DECODE_BATCH).
+static inline int glitch_filter(struct decoder *dec, int64_t *ts, int n,
+                                uint64_t *mask)
+{
+    int64_t last = dec->last;
+    uint64_t bits = 0;
+    int i, kept = 0, keep;
+
+    for (i = 0; i < n; i++) {
+        keep = ts[i] - last >= dec->win.glitch;
+        ts[kept] = ts[i];
+        last = keep ? ts[i] : last;
+        bits |= (uint64_t)keep << (i & 63);
+        kept += keep;
+    }
+    if (mask)
+        *mask = bits;
+
+    dec->stats.glitches += n - kept;
+    return kept;
+}
+
+// The windows never overlap, so at most one of the three tests holds and
+// the symbol is just their sum: 1 for a 0 bit, 2 for a 1 bit, 3 for sync
+static inline uint8_t classify_gap(int64_t gap, const struct pulse_windows *w)
+{
+    return ((gap >= w->zero_min) & (gap < w->zero_max)) |
+           ((gap >= w->one_min) & (gap < w->one_max)) << 1 |
+           ((gap >= w->sync_min) & (gap < w->sync_max)) * 3;
+}
+
+#if defined(__AVX2__)
+// A 4-lane compare mask spread out to one byte per lane (little-endian)
+static const uint32_t sym_spread[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101,
+    0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101,
+    0x01010000, 0x01010001, 0x01010100, 0x01010101
+};
+#endif
+
+// Gaps between n edges (the first measured from prev) to symbols
+static inline void classify_gaps(const int64_t *ts, int n, int64_t prev,
+                                 const struct pulse_windows *w, uint8_t *sym)
+{
+    int i = 0;
+
+    if (n == 0)
+        return;
+    sym[i++] = classify_gap(ts[0] - prev, w);
+
+#if defined(__AVX2__)
+    {
+        // 64-bit lanes, x >= min is !(min > x) and x < max is max > x
+        const __m256i zmin = _mm256_set1_epi64x(w->zero_min - 1);
+        const __m256i zmax = _mm256_set1_epi64x(w->zero_max);
+        const __m256i omin = _mm256_set1_epi64x(w->one_min - 1);
+        const __m256i omax = _mm256_set1_epi64x(w->one_max);
+        const __m256i smin = _mm256_set1_epi64x(w->sync_min - 1);
+        const __m256i smax = _mm256_set1_epi64x(w->sync_max);
+        __m256i gap;
+        uint32_t packed;
+        int mz, mo, ms;
+
+        for (; i + 4 <= n; i += 4) {
+            gap = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *)&ts[i]),
+                                   _mm256_loadu_si256((const __m256i *)&ts[i - 1]));
+            mz = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(
+                     _mm256_cmpgt_epi64(gap, zmin), _mm256_cmpgt_epi64(zmax, gap))));
+            mo = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(
+                     _mm256_cmpgt_epi64(gap, omin), _mm256_cmpgt_epi64(omax, gap))));
+            ms = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(
+                     _mm256_cmpgt_epi64(gap, smin), _mm256_cmpgt_epi64(smax, gap))));
+            packed = sym_spread[mz] | sym_spread[mo] << 1 | sym_spread[ms] * 3;
+            memcpy(&sym[i], &packed, 4);
+        }
+    }
+#elif defined(__SSE4_2__)
+    {
+        const __m128i zmin = _mm_set1_epi64x(w->zero_min - 1);
+        const __m128i zmax = _mm_set1_epi64x(w->zero_max);
+        const __m128i omin = _mm_set1_epi64x(w->one_min - 1);
+        const __m128i omax = _mm_set1_epi64x(w->one_max);
+        const __m128i smin = _mm_set1_epi64x(w->sync_min - 1);
+        const __m128i smax = _mm_set1_epi64x(w->sync_max);
+        __m128i gap;
+        int mz, mo, ms;
+
+        for (; i + 2 <= n; i += 2) {
+            gap = _mm_sub_epi64(_mm_loadu_si128((const __m128i *)&ts[i]),
+                                _mm_loadu_si128((const __m128i *)&ts[i - 1]));
+            mz = _mm_movemask_pd(_mm_castsi128_pd(_mm_and_si128(
+                     _mm_cmpgt_epi64(gap, zmin), _mm_cmpgt_epi64(zmax, gap))));
+            mo = _mm_movemask_pd(_mm_castsi128_pd(_mm_and_si128(
+                     _mm_cmpgt_epi64(gap, omin), _mm_cmpgt_epi64(omax, gap))));
+            ms = _mm_movemask_pd(_mm_castsi128_pd(_mm_and_si128(
+                     _mm_cmpgt_epi64(gap, smin), _mm_cmpgt_epi64(smax, gap))));
+            sym[i] = (mz & 1) | (mo & 1) << 1 | (ms & 1) * 3;
+            sym[i + 1] = (mz >> 1) | (mo >> 1) << 1 | (ms >> 1) * 3;
+        }
+    }
+#elif defined(__ARM_NEON)
+    {
+        // 32-bit NEON has no 64-bit compare, but every window is under a
+        // second, so gaps saturated down to 32 bits classify the same
+        const int32x4_t zmin = vdupq_n_s32(w->zero_min);
+        const int32x4_t zmax = vdupq_n_s32(w->zero_max);
+        const int32x4_t omin = vdupq_n_s32(w->one_min);
+        const int32x4_t omax = vdupq_n_s32(w->one_max);
+        const int32x4_t smin = vdupq_n_s32(w->sync_min);
+        const int32x4_t smax = vdupq_n_s32(w->sync_max);
+        int32x4_t gap;
+        uint32x4_t code;
+        uint16x4_t code16;
+        uint32_t packed;
+
+        for (; i + 4 <= n; i += 4) {
+            gap = vcombine_s32(
+                vqmovn_s64(vsubq_s64(vld1q_s64(&ts[i]), vld1q_s64(&ts[i - 1]))),
+                vqmovn_s64(vsubq_s64(vld1q_s64(&ts[i + 2]), vld1q_s64(&ts[i + 1]))));
+            code = vandq_u32(vandq_u32(vcgeq_s32(gap, zmin), vcltq_s32(gap, zmax)),
+                             vdupq_n_u32(1));
+            code = vorrq_u32(code, vandq_u32(vandq_u32(vcgeq_s32(gap, omin),
+                                                       vcltq_s32(gap, omax)),
+                                             vdupq_n_u32(2)));
+            code = vorrq_u32(code, vandq_u32(vandq_u32(vcgeq_s32(gap, smin),
+                                                       vcltq_s32(gap, smax)),
+                                             vdupq_n_u32(3)));
+            code16 = vmovn_u32(code);
+            packed = vget_lane_u32(vreinterpret_u32_u8(
+                         vmovn_u16(vcombine_u16(code16, code16))), 0);
+            memcpy(&sym[i], &packed, 4);
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+        sym[i] = classify_gap(ts[i] - ts[i - 1], w);
+}
+
+// The bit assembler, returns 1 with the frame in *frame when sym ends one
+static inline int decode_symbol(struct decoder *dec, uint8_t sym, uint64_t *frame)
+{
+    int accepted = 0;
+
+    switch (sym) {
+    case SYM_ZERO:
+    case SYM_ONE:
+        // Keep going
+        if (dec->bitcount++ == 0)
+            dec->stats.started++;
+        dec->buf = (dec->buf << 1) | (sym == SYM_ONE);
+        return 0;
+    case SYM_SYNC:
+        // End of message
+        if (dec->bitcount == 37) {
+            dec->stats.accepted++;
+            *frame = dec->buf;
+            accepted = 1;
+        } else if (dec->bitcount) {
+            dec->stats.aborted_count++;
+        }
+        break;
+    default:
+        // Reset, start again
+        if (dec->bitcount)
+            dec->stats.aborted_gap++;
+    }
+
+    dec->bitcount = 0;
+    dec->buf = 0;
+    return accepted;
+}
+
+// Feed one rising edge, returns 1 with the frame in *frame when it ends one
+static inline int decode_edge(struct decoder *dec, const struct timespec *ts,
+                              uint64_t *frame)
+{
+    int64_t now = timespec_ns(ts);
+    uint8_t sym;
+
+    if (now - dec->last < dec->win.glitch) {
+        dec->stats.glitches++;
+        return 0;
+    }
+    sym = classify_gap(now - dec->last, &dec->win);
+    dec->stats.edges++;
+    dec->last = now;
+    return decode_symbol(dec, sym, frame);
+}
+
+// Feed up to DECODE_BATCH rising edges (nsecs), already through
+// glitch_filter() if wanted, returns how many frames
+// they completed, each in frames[] with the index of its sync edge in at[].
+// Both arrays need DECODE_FRAMES slots. If syms isn't NULL it gets each
+// edge's symbol, DECODE_BATCH slots.
+static inline int decode_batch(struct decoder *dec, const int64_t *ts, int n,
+                               uint64_t *frames, int *at, uint8_t *syms)
+{
+    uint8_t own[DECODE_BATCH], *sym = syms ? syms : own;
+    uint64_t buf = dec->buf, word, issync, accept;
+    uint64_t started = 0, accepted = 0, aborted_count = 0, aborted_gap = 0;
+    int bitcount = dec->bitcount;
+    int i, found = 0;
+
+    if (n <= 0)
+        return 0;
+    classify_gaps(ts, n, dec->last, &dec->win, sym);
+    dec->last = ts[n - 1];
+
+    // The same steps as decode_symbol(), kept in registers
+    for (i = 0; i < n; i++) {
+        // Between frames, step over noise eight symbols at a time
+        if (bitcount == 0) {
+            while (i + 8 <= n) {
+                memcpy(&word, &sym[i], 8);
+                if (word)
+                    break;
+                i += 8;
+            }
+            if (i == n)
+                break;
+            if (sym[i] == SYM_RESET)
+                continue;
+        }
+
+        if (sym[i] == SYM_ZERO || sym[i] == SYM_ONE) {
+            started += bitcount == 0;
+            bitcount++;
+            buf = (buf << 1) | (sym[i] == SYM_ONE);
+            continue;
+        }
+
+        issync = sym[i] == SYM_SYNC;
+        accept = issync & (bitcount == 37);
+        accepted += accept;
+        aborted_count += issync & !accept & (bitcount != 0);
+        aborted_gap += !issync;
+        if (accept) {
+            frames[found] = buf;
+            at[found++] = i;
+        }
+        buf = 0;
+        bitcount = 0;
+    }
+
+    dec->buf = buf;
+    dec->bitcount = bitcount;
+    dec->stats.edges += n;
+    dec->stats.started += started;
+    dec->stats.accepted += accepted;
+    dec->stats.aborted_count += aborted_count;
+    dec->stats.aborted_gap += aborted_gap;
+    return found;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+   Auriol Weather Station - flight recorder of the last few minutes of edges
+
+   The station keeps a POSIX shared memory segment (AURIOL_FLIGHT_NAME)
+   holding a ring of 8-byte records: every rising edge read from the
+   kernel, tagged with the symbol it was classified as or as a glitch the
+   filter dropped, and every frame accepted.
+   It lives in tmpfs, so it survives a station crash, costs no SD card
+   writes and can be read at any time by tests/flight-dump.c. Bit appends,
+   frame starts and resets (with their reason) follow from replaying the
+   symbols, which flight-dump does.
+
+   The station copies the ring to AURIOL_FLIGHT_FILE on SIGUSR1, or by
+   itself when a sensor misses bursts, overwriting the oldest of
+   AURIOL_FLIGHT_DUMPS files. A dump has the same layout as the segment,
+   so the same reader handles both.
+
+   Record layout: top 4 bits type, low 60 bits
+     AURIOL_FLIGHT_RESET..SYNC  CLOCK_MONOTONIC nsecs of the edge
+     AURIOL_FLIGHT_FRAME        the 37-bit frame ended by the edge before
+     AURIOL_FLIGHT_DUMP         CLOCK_MONOTONIC nsecs a dump was asked for
+     AURIOL_FLIGHT_GLITCH       CLOCK_MONOTONIC nsecs of a dropped spike
+
+   Times are always CLOCK_MONOTONIC: CLOCK_REALTIME nsecs don't fit in 60
+   bits, so edges stamped that way by kernels before 5.7 are converted
+   with wall_offset on the way in.
+
+   Link with -lrt on glibc older than 2.34.
+*/
+
+#ifndef AURIOL_FLIGHT_H
+#define AURIOL_FLIGHT_H
+
+#include <stdint.h>       // uint*_t
+#include <fcntl.h>        // O_* flags
+#include <unistd.h>       // close()
+#include <sys/mman.h>     // shm_open(), mmap()
+#include "auriol-decode.h" // Symbols, pulse windows
+
+#define AURIOL_FLIGHT_NAME    "/auriol-flight"
+#define AURIOL_FLIGHT_FILE    "/var/tmp/auriol-flight-%d.rec"
+#define AURIOL_FLIGHT_DUMPS   4 // Files kept, 4MB each
+#define AURIOL_FLIGHT_MAGIC   0x41555246 // "AURF"
+#define AURIOL_FLIGHT_VERSION 2
+#define AURIOL_FLIGHT_RECORDS (1 << 19) // 4MB, minutes of edges even in RF noise
+
+// Record types, edges use the decoder's SYM_* values
+enum {
+    AURIOL_FLIGHT_RESET = SYM_RESET,
+    AURIOL_FLIGHT_ZERO = SYM_ZERO,
+    AURIOL_FLIGHT_ONE = SYM_ONE,
+    AURIOL_FLIGHT_SYNC = SYM_SYNC,
+    AURIOL_FLIGHT_FRAME,
+    AURIOL_FLIGHT_DUMP,
+    AURIOL_FLIGHT_GLITCH
+};
+
+#define AURIOL_FLIGHT_TYPE(r)  ((unsigned int)((r) >> 60))
+#define AURIOL_FLIGHT_VALUE(r) ((r) & 0x0FFFFFFFFFFFFFFFULL)
+#define AURIOL_FLIGHT_RECORD(type, value) \
+    ((uint64_t)(type) << 60 | ((uint64_t)(value) & 0x0FFFFFFFFFFFFFFFULL))
+
+struct auriol_flight_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t head;        // Records ever written, the next goes at head % RECORDS
+    uint64_t valid_from;  // In a dump, older records were overwritten mid-copy
+    int64_t wall_offset;  // CLOCK_REALTIME - CLOCK_MONOTONIC, nsecs
+    struct pulse_windows win; // Windows the symbols were classified with
+};
+
+struct auriol_flight {
+    struct auriol_flight_header h;
+    uint64_t rec[AURIOL_FLIGHT_RECORDS];
+};
+
+// Edge stamps from kernels before 5.7 are CLOCK_REALTIME, told apart by
+// being closer to the offset than to zero, as the station's wallclock_ms()
+// does
+static inline int64_t auriol_flight_monotonic(const struct auriol_flight *fl,
+                                              int64_t ns)
+{
+    return ns >= fl->h.wall_offset / 2 ? ns - fl->h.wall_offset : ns;
+}
+
+// Reader side: wall-clock nsecs of a record's time
+static inline int64_t auriol_flight_wall(const struct auriol_flight *fl,
+                                         int64_t ns)
+{
+    return ns < fl->h.wall_offset / 2 ? ns + fl->h.wall_offset : ns;
+}
+
+// Station side: append a batch as it was read, before glitch_filter().
+// Edges the filter dropped (clear in mask, as glitch_filter() left it)
+// are logged as glitches, the rest tagged with the symbol decode_batch()
+// gave them, and each accepted frame follows its sync edge. Nothing is
+// worked out again, tests/decode-bench.c measures what this costs.
+static inline void auriol_flight_record(struct auriol_flight *fl,
+                                        const int64_t *ts, int n, uint64_t mask,
+                                        const uint8_t *sym, const uint64_t *frames,
+                                        const int *at, int found)
+{
+    uint64_t head = fl->h.head;
+    int i, j = 0, k = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!(mask >> i & 1)) {
+            fl->rec[head++ & (AURIOL_FLIGHT_RECORDS - 1)] =
+                AURIOL_FLIGHT_RECORD(AURIOL_FLIGHT_GLITCH,
+                                     auriol_flight_monotonic(fl, ts[i]));
+            continue;
+        }
+        fl->rec[head++ & (AURIOL_FLIGHT_RECORDS - 1)] =
+            AURIOL_FLIGHT_RECORD(sym[k], auriol_flight_monotonic(fl, ts[i]));
+        if (j < found && at[j] == k)
+            fl->rec[head++ & (AURIOL_FLIGHT_RECORDS - 1)] =
+                AURIOL_FLIGHT_RECORD(AURIOL_FLIGHT_FRAME, frames[j++]);
+        k++;
+    }
+
+    // Readers only look below head
+    __atomic_store_n(&fl->h.head, head, __ATOMIC_RELEASE);
+}
+
+// Station side: append a single record
+static inline void auriol_flight_mark(struct auriol_flight *fl, int type,
+                                      uint64_t value)
+{
+    uint64_t head = fl->h.head;
+
+    fl->rec[head & (AURIOL_FLIGHT_RECORDS - 1)] = AURIOL_FLIGHT_RECORD(type, value);
+    __atomic_store_n(&fl->h.head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Map the station's live ring read-only, NULL (with errno set) on failure
+static inline struct auriol_flight *auriol_flight_open(void)
+{
+    struct auriol_flight *fl;
+    int fd;
+
+    fd = shm_open(AURIOL_FLIGHT_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    fl = mmap(NULL, sizeof(*fl), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (fl == MAP_FAILED)
+        return NULL;
+
+    if (fl->h.magic != AURIOL_FLIGHT_MAGIC || fl->h.version != AURIOL_FLIGHT_VERSION) {
+        munmap(fl, sizeof(*fl));
+        return NULL;
+    }
+
+    return fl;
+}
+
+// Map a dump file, NULL on failure
+static inline struct auriol_flight *auriol_flight_load(const char *path)
+{
+    struct auriol_flight *fl;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    fl = mmap(NULL, sizeof(*fl), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (fl == MAP_FAILED)
+        return NULL;
+
+    if (fl->h.magic != AURIOL_FLIGHT_MAGIC || fl->h.version != AURIOL_FLIGHT_VERSION) {
+        munmap(fl, sizeof(*fl));
+        return NULL;
+    }
+
+    return fl;
+}
+
+static inline void auriol_flight_close(struct auriol_flight *fl)
+{
+    munmap(fl, sizeof(*fl));
+}
+
+// Oldest record still held, index up to (not including) head
+static inline uint64_t auriol_flight_first(const struct auriol_flight *fl,
+                                           uint64_t head)
+{
+    uint64_t first = head > AURIOL_FLIGHT_RECORDS ? head - AURIOL_FLIGHT_RECORDS : 0;
+
+    return first > fl->h.valid_from ? first : fl->h.valid_from;
+}
+
+static inline uint64_t auriol_flight_get(const struct auriol_flight *fl, uint64_t i)
+{
+    return fl->rec[i & (AURIOL_FLIGHT_RECORDS - 1)];
+}
+
+#endif
@@ -2,7 +2,35 @@
    Auriol Weather Station Remote Decoder
    IAN: 331821_1907
 
-   Compile: gcc -o auriol auriol.c -lgpiod
+   Compile: gcc -o auriol-lcd-mqtt auriol-lcd-mqtt.c -lgpiod -lmosquitto -lrt -lpthread
+   Usage:   auriol-lcd-mqtt [dedup window ms]
+
+   Fixed footprint build (add -DAURIOL_NO_HEAP): stdio gets static buffers,
+   threads small stacks, and the heap is reserved, prefaulted and locked
+   at startup, so nothing on the receive, decode or publish path grows the
+   process after that. While the broker is away (in any build) readings
+   wait in a fixed ring of MQTT_BACKLOG, oldest dropped first, and claims
+   and stats aren't sent, so libmosquitto never queues more than a
+   connection's worth.
+   tests/alloc-count-test.c checks the steady state makes no allocations
+   and that the heap never grows past what was reserved.
+
+   Readings are stamped with the kernel timestamp of their sync edge, in
+   wall-clock milliseconds. The kernel stamps edges on CLOCK_MONOTONIC, so
+   the offset to CLOCK_REALTIME is measured every WALLCLOCK_INTERVAL and
+   an NTP step only moves the series at a recalibration, never mid-burst.
+
+   Dedup mode (a window > 0) is for stations sharing a broker that hear
+   the same sensors. Before publishing a reading a station posts a
+   retained claim on weather/claim/<uid>/<channel>, holds the reading for
+   the window, and drops it if a station with a lower name claimed the
+   same frame within a burst of it. Exactly one copy reaches
+   weather/<station>/raw as long as claims arrive inside the window.
+
+   The last few minutes of edges and accepted frames are kept in a flight
+   recorder ring (see auriol-flight.h). `kill -USR1` copies it to
+   /var/tmp, as does a settled sensor missing FLIGHT_MISSED bursts in a
+   row. Only the newest AURIOL_FLIGHT_DUMPS copies are kept.
 
    Structure in bits: 
     0-7   = UID
@@ -23,12 +51,30 @@
     Ch3 Transmission = every 79 secs
 */
 
+#ifdef AURIOL_NO_HEAP
+#define _GNU_SOURCE // pthread_setattr_default_np()
+#endif
+
 #include <stdio.h>  // printf()
 #include <stdint.h> // uint*_h
+#include <stdlib.h> // exit()
+#include <stddef.h> // offsetof()
 #include <string.h> // str manip
-#include <unistd.h> // sleep(), usleep()
+#include <limits.h> // INT_MAX
+#include <errno.h>  // EINTR
+#include <signal.h> // SIGUSR1
+#include <unistd.h> // close(), ftruncate(), gethostname()
+#include <sys/stat.h> // stat()
+#include <pthread.h> // Claims arrive on the MQTT thread
 #include <gpiod.h>  // GPIO ops
 #include <mosquitto.h>
+#include "auriol-decode.h" // Frame layout and edge decoder
+#include "auriol-shm.h" // Shared memory table for local readers
+#include "auriol-flight.h" // Flight recorder ring
+#include "hd44780.h" // LCD driver
+#ifdef AURIOL_NO_HEAP
+#include <malloc.h> // mallopt()
+#endif
 
 #define GPIOPINS 22, 23, 24, 25, 18, 17, 4
 
@@ -42,24 +88,50 @@ enum {
     GPIORX
 };
 
-struct var_s {
-    uint8_t coda : 4; 
-    uint16_t humidity : 8; // Don't ask
-    uint8_t unknown : 4; 
-    int16_t celcius : 12; 
-    uint8_t channel : 2;
-    uint8_t manual : 1;
-    uint8_t charge : 1;
-    uint8_t sensor : 8;
-    uint32_t null : 24;
-}__attribute((__packed__));
-
-union tempdata {
-    struct var_s var;
-    uint64_t raw;
+#define DASH_SLOTS 12   // Sensor/channel pairs the dashboard cycles through
+#define DASH_ROTATE 4   // Seconds each page stays on screen
+
+struct dashboard {
+    union tempdata readings[DASH_SLOTS];
+    time_t heard[DASH_SLOTS];
+    int count, page;
+    time_t next; // When to show the next page
 };
 
-void lcd_line_set(struct gpiod_line_bulk *lines, int index, int value) {
+#define BURST_WINDOW 5 // Seconds a burst of repeated frames lasts, at most
+#define BURST_RAWS 4   // Different frames told apart within one burst
+#define STATS_INTERVAL 300 // Seconds between reception telemetry messages
+#define STATS_TRAILER 24    // Kept free for ";part=N/N"
+#define STATS_EXPIRE 20     // Periods unheard before a sensor's counters go
+#define FLIGHT_CHECK 60     // Seconds between looks for sensors gone quiet
+#define FLIGHT_SETTLED 4    // Periods heard before a sensor's silence counts
+#define FLIGHT_MISSED 2     // Bursts missed in a row that dump the recorder
+#define FLIGHT_QUIET 600    // Seconds between automatic dumps, at least
+
+// Frames heard in the current burst per sensor and channel, to drop the
+// repeats, along with its reception telemetry
+struct sensor_state {
+    uint64_t burst_raw[BURST_RAWS];
+    uint8_t burst_count[BURST_RAWS]; // Times each was heard, up to 255
+    uint8_t nburst_raw;
+    int64_t burst_ms;      // Sync edge of the first frame of the current burst
+    uint32_t accepted;     // Frames decoded, repeats included
+    uint32_t bursts;
+    uint32_t aborted;      // Frames lost in between the repeats of a burst
+    uint32_t missed;       // Bursts never heard, going by the period
+    uint16_t burst_frames; // Frames heard in the current burst
+    uint16_t last_burst_frames;
+    int32_t period_ms;     // Last inter-burst period
+    int32_t periods;
+    int64_t drift_ms;      // Sum of (period - expected) over all periods
+    int64_t heard_ms;      // Wall-clock ms of the last frame
+    uint32_t charge;       // Battery flag per burst, newest in bit 0
+    uint8_t dumped;        // Flight recorder dumped for this silence
+};
+
+// GPIO backend for the LCD driver, one ioctl per line write
+void lcd_line_set(void *ctx, int index, int value) {
+    struct gpiod_line_bulk *lines = ctx;
     int ret = 0;
     struct gpiod_line *line;
 
@@ -71,138 +143,873 @@ void lcd_line_set(struct gpiod_line_bulk *lines, int index, int value) {
     }
 }
 
-void lcd_line_pulse(struct gpiod_line_bulk *lines) {
-    lcd_line_set(lines, GPIOEN, 1);
-    usleep(20);
-    lcd_line_set(lines, GPIOEN, 0);
-    usleep(37);
+// Remember a reading and put it on screen straight away
+void dashboard_update(struct dashboard *dash, union tempdata *u, time_t now) {
+    int i, slot = 0;
+
+    for (i = 0; i < dash->count; i++) {
+        if (dash->readings[i].var.sensor == u->var.sensor &&
+            dash->readings[i].var.channel == u->var.channel)
+            break;
+        // Remember the stalest in case we need to evict it
+        if (dash->heard[i] < dash->heard[slot])
+            slot = i;
+    }
+
+    if (i < dash->count)
+        slot = i;
+    else if (dash->count < DASH_SLOTS)
+        slot = dash->count++;
+
+    dash->readings[slot] = *u;
+    dash->heard[slot] = now;
+    dash->page = slot;
+    dash->next = now;
 }
 
-void lcd_set_nibble(struct gpiod_line_bulk *lines, uint8_t mode, uint8_t nibble) {
-    int i, ret;
+// Rotate through every known sensor/channel
+void dashboard_tick(struct dashboard *dash, struct lcd *lcd, time_t now) {
+    union tempdata *u;
+    char msg[2 * LCD_WIDTH + 2];
+    char age[5]; // "999s", "999m" or "999h"
+    long secs;
 
-    lcd_line_set(lines, GPIORS, mode);
+    if (dash->count == 0 || now < dash->next)
+        return;
 
-    for (i=0; i<5; i++) 
-	lcd_line_set(lines, i, 0);
+    u = &dash->readings[dash->page];
+    // Stamps come from the edge clock, a backward step can put them ahead
+    secs = now - dash->heard[dash->page];
+    if (secs < 0)
+        secs = 0;
+    if (secs < 1000)
+        snprintf(age, sizeof(age), "%3lds", secs);
+    else if (secs < 60000)
+        snprintf(age, sizeof(age), "%3ldm", secs / 60);
+    else
+        snprintf(age, sizeof(age), "%3ldh", (secs / 3600) % 1000);
 
-    for (i=0; i<4; i++) 
-	lcd_line_set(lines, i, (nibble>>i & 1));
+    snprintf(msg, sizeof(msg), "#%u %5.1f\337C %3u%%\nid%02x bat:%s %s",
+	   u->var.channel + 1, ((float)u->var.celcius / 10), u->var.humidity,
+	   u->var.sensor, u->var.charge ? "ok" : "lo", age);
 
-    // Commit nibble to the display
-    lcd_line_pulse(lines);
+    // Try again next time round if the display is still catching up
+    if (lcd_send_msg(lcd, msg) != 0)
+        return;
+
+    dash->page = (dash->page + 1) % dash->count;
+    dash->next = now + DASH_ROTATE;
 }
 
-void lcd_set_byte(struct gpiod_line_bulk *lines, uint8_t mode, uint8_t byte) {
-    lcd_set_nibble(lines, mode, (byte>>4) & 0xf);
-    lcd_set_nibble(lines, mode, (byte) & 0xf);
+#define MQTT_BACKLOG 256 // Readings kept while the broker is away
+#define WALLCLOCK_INTERVAL 60 // Seconds between offset recalibrations
+#define STATION_NAME 64
+
+// The latest claim on a sensor/channel by another station
+struct claim {
+    uint64_t raw;
+    int64_t ms;  // Wall-clock stamp of the claimed reading
+    char station[STATION_NAME];
+};
+
+// A reading waiting for the broker
+struct reading {
+    uint64_t raw;
+    int64_t ms;
+};
+
+// A reading waiting out the dedup window
+struct pending {
+    uint64_t raw;
+    int64_t ms;
+    int64_t due; // CLOCK_MONOTONIC nsecs
+    int held;
+};
+
+// Maps kernel edge timestamps to wall-clock time
+struct wallclock {
+    int64_t offset; // CLOCK_REALTIME - CLOCK_MONOTONIC, nsecs
+    int64_t next;   // CLOCK_MONOTONIC nsecs of the next recalibration
+};
+
+struct station {
+    struct timespec started; // Process start, for time to first decode
+    struct wallclock clock;
+    int decoded;             // Set once the first frame is in
+    struct decoder dec;
+    uint64_t aborted_mark; // Decoder aborts as of the last accepted frame
+    time_t stats_next;
+    struct lcd lcd;
+    struct dashboard dash;
+    struct sensor_state sensors[4][256]; // By channel, then UID
+    struct mosquitto *mqtt;
+    int connected;       // Set and cleared by the MQTT thread
+    struct reading backlog[MQTT_BACKLOG]; // Not yet handed to libmosquitto
+    unsigned int backlog_head, backlog_tail;
+    uint64_t backlog_lost;
+    char rawtopic[80];   // weather/<station>/raw
+    char statstopic[80]; // weather/<station>/stats
+    char name[STATION_NAME];
+    struct auriol_shm *shm;
+
+    // Dedup across stations, off while dedup_ms is 0
+    int dedup_ms;
+    pthread_mutex_t claimlock;
+    struct claim claims[4][256]; // By channel, then UID
+    struct pending pending[4][256];
+    int npending;
+    uint64_t deduped;
+
+    // Flight recorder, NULL if the segment couldn't be set up
+    struct auriol_flight *flight;
+    int dumping;              // A dump thread is still copying
+    time_t flight_next;       // Next look for sensors gone quiet
+    time_t flight_quiet;      // No automatic dump before this
+};
+
+static volatile sig_atomic_t flight_requested;
+
+#ifdef AURIOL_NO_HEAP
+#ifndef HEAP_RESERVE
+#define HEAP_RESERVE (256 * 1024) // Heap for libmosquitto's packet buffers
+#endif
+#ifndef THREAD_STACK
+#define THREAD_STACK (128 * 1024)
+#endif
+
+static char stdout_buf[BUFSIZ], stderr_buf[BUFSIZ];
+
+// Everything the process will ever need is set aside here, before the
+// first edge: stdio buffers are static, and libmosquitto's allocations
+// are served from one prefaulted, locked heap that is never trimmed
+void fixed_footprint_init(void) {
+    pthread_attr_t attr;
+    char *reserve;
+
+    setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
+    setvbuf(stderr, stderr_buf, _IONBF, sizeof(stderr_buf));
+
+    // One arena for all threads, carved from brk only, never handed back
+    mallopt(M_ARENA_MAX, 1);
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_TRIM_THRESHOLD, -1);
+
+    // Locked memory includes every thread's whole stack, libmosquitto's
+    // and the flight dumps' need far less than the 8MB default
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    if (pthread_setattr_default_np(&attr) != 0)
+        fprintf(stderr, "unable to set thread stack size\n");
+    pthread_attr_destroy(&attr);
+
+    reserve = malloc(HEAP_RESERVE);
+    if (!reserve) {
+        fprintf(stderr, "failure reserving heap\n");
+        exit(8);
+    }
+    memset(reserve, 0, HEAP_RESERVE);
+    free(reserve);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "unable to lock memory, pages may still fault\n");
+}
+#endif
+
+long ms_since(const struct timespec *start) {
+    struct timespec now, gap;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timesecdiff(start, &now, &gap);
+    return gap.tv_sec * 1000 + gap.tv_nsec / 1000000;
 }
 
-void lcd_send_msg(struct gpiod_line_bulk *lines, char *str) {
+// Read the realtime clock between two monotonic reads and keep the
+// tightest of a few tries, so a preemption doesn't skew the offset
+void wallclock_calibrate(struct wallclock *wc) {
+    struct timespec m1, rt, m2;
+    int64_t offset = 0, best = INT64_MAX, span;
     int i;
-    lcd_set_byte(lines, 0, 0x01); // Clear display
-    usleep(1520);
-    lcd_set_byte(lines, 0, 0x80); // Line 1 
-    for (i = 0; i < strlen(str); i++) {
-	// Line feed
-        if ( str[i] == 0x0A ) {
-            lcd_set_byte(lines, 0, 0xC0); // Line 2
-	} else {
-            lcd_set_byte(lines, 1, str[i]);
-	}
+
+    for (i = 0; i < 3; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &m1);
+        clock_gettime(CLOCK_REALTIME, &rt);
+        clock_gettime(CLOCK_MONOTONIC, &m2);
+        span = timespec_ns(&m2) - timespec_ns(&m1);
+        if (span < best) {
+            best = span;
+            offset = timespec_ns(&rt) - timespec_ns(&m1) - span / 2;
+        }
+    }
+
+    if (wc->next && llabs(offset - wc->offset) > 1000000000LL)
+        printf("Wall clock stepped by %lld ms\n",
+               (long long)(offset - wc->offset) / 1000000);
+    wc->offset = offset;
+    wc->next = timespec_ns(&m2) + WALLCLOCK_INTERVAL * 1000000000LL;
+}
+
+// Kernels before 5.7 stamp edges with CLOCK_REALTIME already, those are
+// told apart by being closer to the offset than to zero
+int64_t wallclock_ms(const struct wallclock *wc, const struct timespec *ts) {
+    int64_t ns = timespec_ns(ts);
+
+    if (ns < wc->offset / 2)
+        ns += wc->offset;
+    return ns / 1000000;
+}
+
+// Create (or reuse) the shared memory table of latest readings
+struct auriol_shm *shm_create(void) {
+    struct auriol_shm *shm;
+    struct auriol_shm_entry *e;
+    int fd, ret, ch, id;
+
+    fd = shm_open(AURIOL_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "failure opening shared memory\n");
+        exit(7);
+    }
+
+    ret = ftruncate(fd, sizeof(*shm));
+    if (ret != 0) {
+        fprintf(stderr, "failure sizing shared memory\n");
+        exit(7);
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "failure mapping shared memory\n");
+        exit(7);
     }
+
+    // Stale layout from an older station, start afresh
+    if (shm->magic != AURIOL_SHM_MAGIC || shm->version != AURIOL_SHM_VERSION) {
+        memset(shm, 0, sizeof(*shm));
+        shm->version = AURIOL_SHM_VERSION;
+        __atomic_store_n(&shm->magic, AURIOL_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    // A station killed mid-update leaves that slot's seq odd, which readers
+    // would wait out forever. Its contents are half written, drop them.
+    for (ch = 0; ch < AURIOL_SHM_CHANNELS; ch++) {
+        for (id = 0; id < AURIOL_SHM_SENSORS; id++) {
+            e = &shm->entry[ch][id];
+            if (!(e->seq & 1))
+                continue;
+            e->valid = 0;
+            __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    return shm;
 }
 
-void lcd_init_4bit_16x2(struct gpiod_line_bulk *lines) {
-    // 4 Bit setup
-    lcd_set_nibble(lines, 0, 0x3);
-    usleep(4100);
-    lcd_set_nibble(lines, 0, 0x3);
-    usleep(100);
-    lcd_set_byte(lines, 0, 0x32);
+// Create (or reuse) the flight recorder ring, a station without one still
+// runs
+struct auriol_flight *flight_create(const struct pulse_windows *win) {
+    struct auriol_flight *fl;
+    int fd, ret;
+
+    fd = shm_open(AURIOL_FLIGHT_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "failure opening flight recorder\n");
+        return NULL;
+    }
 
-    // Set up screen
-    lcd_set_byte(lines, 0, 0x06); // Cursor appends (+1)
-    lcd_set_byte(lines, 0, 0x0C); // Display on, Cursor off, Blink off
-    lcd_set_byte(lines, 0, 0x28); // Two lines, 4 bits
+    ret = ftruncate(fd, sizeof(*fl));
+    fl = ret == 0 ? mmap(NULL, sizeof(*fl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (fl == MAP_FAILED) {
+        fprintf(stderr, "failure mapping flight recorder\n");
+        return NULL;
+    }
+
+    // Keep what an earlier run recorded, it may be why we restarted
+    if (fl->h.magic != AURIOL_FLIGHT_MAGIC || fl->h.version != AURIOL_FLIGHT_VERSION) {
+        memset(fl, 0, sizeof(*fl));
+        fl->h.version = AURIOL_FLIGHT_VERSION;
+        __atomic_store_n(&fl->h.magic, AURIOL_FLIGHT_MAGIC, __ATOMIC_RELEASE);
+    }
+    fl->h.win = *win;
 
-    // Clear and wait
-    lcd_set_byte(lines, 0, 0x01); // Clear display
-    usleep(1520);
+    return fl;
 }
 
-// Used to calculate time difference
-static inline void timesecdiff(struct timespec *old, struct timespec *new,
-                               struct timespec *diff)
-{
-    diff->tv_sec = new->tv_sec - old->tv_sec;
-    diff->tv_nsec = new->tv_nsec - old->tv_nsec;
-    if (diff->tv_nsec < 0) {
-        diff->tv_nsec += 1000000000L;
-        diff->tv_sec--;
+// Copy the ring out, off the receive path: the copy is a few MB and the
+// kernel only holds 16 edges
+// The first of the AURIOL_FLIGHT_DUMPS files not there yet, or the oldest
+void flight_dump_path(char *path, size_t size) {
+    struct stat sb;
+    time_t oldest = 0;
+    int i, slot = 0;
+
+    for (i = 0; i < AURIOL_FLIGHT_DUMPS; i++) {
+        snprintf(path, size, AURIOL_FLIGHT_FILE, i);
+        if (stat(path, &sb) != 0)
+            return;
+        if (i == 0 || sb.st_mtime < oldest) {
+            oldest = sb.st_mtime;
+            slot = i;
+        }
+    }
+    snprintf(path, size, AURIOL_FLIGHT_FILE, slot);
+}
+
+void *flight_dump_thread(void *arg) {
+    struct station *st = arg;
+    struct auriol_flight *fl = st->flight;
+    struct auriol_flight_header hdr;
+    uint64_t after;
+    char path[64];
+    int fd, ok;
+
+    flight_dump_path(path, sizeof(path));
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "failure creating %s\n", path);
+        __atomic_store_n(&st->dumping, 0, __ATOMIC_RELEASE);
+        return NULL;
     }
+
+    hdr = fl->h;
+    hdr.head = __atomic_load_n(&fl->h.head, __ATOMIC_ACQUIRE);
+    ok = pwrite(fd, fl->rec, sizeof(fl->rec), offsetof(struct auriol_flight, rec)) ==
+         sizeof(fl->rec);
+
+    // Whatever was written meanwhile overwrote the oldest records
+    after = __atomic_load_n(&fl->h.head, __ATOMIC_ACQUIRE);
+    hdr.valid_from = after > AURIOL_FLIGHT_RECORDS ? after - AURIOL_FLIGHT_RECORDS : 0;
+    ok &= pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    close(fd);
+
+    if (ok)
+        printf("Flight recorder dumped to %s\n", path);
+    else
+        fprintf(stderr, "failure writing %s\n", path);
+    __atomic_store_n(&st->dumping, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void flight_dump(struct station *st, const char *why) {
+    struct timespec now;
+    pthread_t thread;
+
+    if (!st->flight || __atomic_exchange_n(&st->dumping, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    printf("Dumping flight recorder, %s\n", why);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    auriol_flight_mark(st->flight, AURIOL_FLIGHT_DUMP, timespec_ns(&now));
+    if (pthread_create(&thread, NULL, flight_dump_thread, st) != 0) {
+        fprintf(stderr, "failure starting flight recorder dump\n");
+        __atomic_store_n(&st->dumping, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Dump when a sensor that kept to its schedule misses FLIGHT_MISSED
+// bursts in a row, once per silence. A single missed burst is everyday
+// RF, and the ring still holds the bursts that should have been there.
+void flight_check(struct station *st, time_t now) {
+    struct sensor_state *state;
+    struct timespec ts;
+    int64_t ms, expected;
+    int ch, id, quiet = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ms = timespec_ns(&ts) / 1000000;
+    for (ch = 0; ch < 4; ch++) {
+        expected = ((ch + 1) * 10 + 49) * 1000LL;
+        for (id = 0; id < 256; id++) {
+            state = &st->sensors[ch][id];
+            if (state->periods < FLIGHT_SETTLED || state->dumped ||
+                ms - state->heard_ms < (FLIGHT_MISSED + 0.5) * expected)
+                continue;
+            state->dumped = 1;
+            quiet++;
+        }
+    }
+    if (quiet && now >= st->flight_quiet) {
+        flight_dump(st, "sensor missed bursts");
+        st->flight_quiet = now + FLIGHT_QUIET;
+    }
+}
+
+void cb_sigusr1(int sig) {
+    flight_requested = 1;
+}
+
+// Seqlock write of one reading, then wake anyone waiting for a change
+void shm_update(struct auriol_shm *shm, union tempdata *u, int64_t ms) {
+    struct auriol_shm_entry *e = &shm->entry[u->var.channel][u->var.sensor];
+    uint32_t seq = e->seq;
+
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->sensor = u->var.sensor;
+    e->channel = u->var.channel;
+    e->charge = u->var.charge;
+    e->manual = u->var.manual;
+    e->celcius = u->var.celcius;
+    e->humidity = u->var.humidity;
+    e->valid = 1;
+    e->time_ms = ms;
+    e->raw = u->raw;
+
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&shm->generation, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &shm->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 }
 
 void cb_connect(struct mosquitto *mqtt, void *obj, int code) {
+	struct station *st = obj;
+
 	printf("Connection status: %s\n", mosquitto_connack_string(code));
+	// Refused, e.g. a broker still starting up: libmosquitto drops the
+	// connection and the reconnect backoff tries again. Disconnecting
+	// here would stop it retrying for good.
 	if (code)
-		mosquitto_disconnect(mqtt);
+		return;
+	__atomic_store_n(&st->connected, 1, __ATOMIC_RELEASE);
+	// Retained claims arrive straight away, so a restart rejoins at once
+	if (st->dedup_ms)
+		mosquitto_subscribe(mqtt, NULL, "weather/claim/#", 1);
+}
+
+void cb_disconnect(struct mosquitto *mqtt, void *obj, int code) {
+	struct station *st = obj;
+
+	__atomic_store_n(&st->connected, 0, __ATOMIC_RELEASE);
+	if (code)
+		printf("Lost connection to broker, retrying\n");
 }
 
 void cb_publish(struct mosquitto *mqtt, void *obj, int msg_id) {
  	printf("Message sent as: %u\n", msg_id);
 }	
 
-void parseprintwait(struct gpiod_line_bulk *lines, struct mosquitto *mqtt, uint64_t buf)
-{
+// Another station's claim, "<ms> <raw> <station>"
+void cb_message(struct mosquitto *mqtt, void *obj,
+                const struct mosquitto_message *msg) {
+    struct station *st = obj;
+    char buf[128], name[STATION_NAME];
+    unsigned long long raw;
+    long long ms;
     union tempdata u;
+    struct claim *c;
+    int len;
+
+    len = msg->payloadlen < sizeof(buf) - 1 ? msg->payloadlen : sizeof(buf) - 1;
+    memcpy(buf, msg->payload, len);
+    buf[len] = 0;
+    if (sscanf(buf, "%lld %llu %63s", &ms, &raw, name) != 3 ||
+        strcmp(name, st->name) == 0)
+        return;
+
+    u.raw = raw & 0xFFFFFFFFFF;
+    c = &st->claims[u.var.channel][u.var.sensor];
+    pthread_mutex_lock(&st->claimlock);
+    // Claims for one frame arrive in any order, the lowest name holds it.
+    // A different frame, or the same one a period later, replaces it.
+    if (c->station[0] && c->raw == u.raw && llabs(c->ms - ms) < BURST_WINDOW * 1000) {
+        if (strcmp(name, c->station) < 0)
+            strcpy(c->station, name);
+    } else if (c->raw != u.raw || ms > c->ms) {
+        c->raw = u.raw;
+        c->ms = ms;
+        strcpy(c->station, name);
+    }
+    pthread_mutex_unlock(&st->claimlock);
+}
+
+// Per sensor/channel reception telemetry, returns 1 for repeats in a burst
+int sensor_heard(struct station *st, struct sensor_state *state,
+                 union tempdata *u, const struct timespec *ts)
+{
+    int64_t ms = ts->tv_sec * 1000LL + ts->tv_nsec / 1000000;
+    int64_t expected = ((u->var.channel + 1) * 10 + 49) * 1000LL;
+    uint64_t aborts = st->dec.stats.aborted_gap + st->dec.stats.aborted_count;
+    int64_t n;
+
+    state->accepted++;
+    state->heard_ms = wallclock_ms(&st->clock, ts);
+
+    // Aborted frames since the last repeat of this burst are ours
+    if (state->bursts && ms - state->burst_ms < BURST_WINDOW * 1000) {
+        state->burst_frames++;
+        state->aborted += aborts - st->aborted_mark;
+        st->aborted_mark = aborts;
+        return 1;
+    }
+    st->aborted_mark = aborts;
+
+    // New burst, how far off the 59/69/79s schedule was it?
+    if (state->bursts) {
+        n = (ms - state->burst_ms + expected / 2) / expected;
+        if (n < 1)
+            n = 1;
+        state->missed += n - 1;
+        state->period_ms = (ms - state->burst_ms) / n;
+        state->drift_ms += state->period_ms - expected;
+        state->periods++;
+        state->last_burst_frames = state->burst_frames;
+    }
+    state->bursts++;
+    state->dumped = 0;
+    state->burst_frames = 1;
+    state->burst_ms = ms;
+    state->charge = (state->charge << 1) | u->var.charge;
+    return 0;
+}
+
+// Within a burst, report the first frame and any other heard twice. A
+// frame that differs just once is a bit error the decoder can't catch,
+// there's no checksum.
+int burst_report(struct sensor_state *state, uint64_t raw, int repeat)
+{
+    int i;
+
+    if (!repeat)
+        state->nburst_raw = 0;
+    for (i = 0; i < state->nburst_raw; i++)
+        if (state->burst_raw[i] == raw)
+            break;
+    if (i == state->nburst_raw) {
+        if (i == BURST_RAWS)
+            return 0;
+        state->burst_raw[i] = raw;
+        state->burst_count[i] = 0;
+        state->nburst_raw++;
+    }
+
+    if (state->burst_count[i] < 255)
+        state->burst_count[i]++;
+    return state->burst_count[i] == (i == 0 ? 1 : 2);
+}
+
+// "<wall-clock ms>: <raw>"
+void reading_send(struct station *st, struct reading *r)
+{
     char msg[33];
-    char mqtttopic[] = "weather/raw";
     int ret;
 
+    sprintf(msg, "%lld: %llu", (long long)r->ms, (unsigned long long)r->raw);
+    // The reading is already on stdout, the LCD and in shared memory
+    ret = mosquitto_publish(st->mqtt, NULL, st->rawtopic, strlen(msg), msg, 2, false);
+    if (ret != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Couldn't publish: %s\n", mosquitto_strerror(ret));
+}
+
+// Hand the backlog to libmosquitto, in order, once the broker is there
+void backlog_flush(struct station *st)
+{
+    while (st->backlog_tail != st->backlog_head &&
+           __atomic_load_n(&st->connected, __ATOMIC_ACQUIRE))
+        reading_send(st, &st->backlog[st->backlog_tail++ % MQTT_BACKLOG]);
+}
+
+// Readings go through a fixed ring, so a broker outage costs the oldest
+// readings rather than an ever growing libmosquitto queue
+void reading_publish(struct station *st, uint64_t raw, int64_t ms)
+{
+    struct reading *r;
+
+    if (st->backlog_head - st->backlog_tail == MQTT_BACKLOG) {
+        st->backlog_tail++;
+        st->backlog_lost++;
+    }
+    r = &st->backlog[st->backlog_head++ % MQTT_BACKLOG];
+    r->raw = raw;
+    r->ms = ms;
+    backlog_flush(st);
+}
+
+// Has a station that outranks us claimed this very reading?
+int claim_beaten(struct station *st, union tempdata *u, int64_t ms)
+{
+    struct claim *c = &st->claims[u->var.channel][u->var.sensor];
+    int beaten;
+
+    pthread_mutex_lock(&st->claimlock);
+    beaten = c->raw == u->raw && llabs(c->ms - ms) < BURST_WINDOW * 1000 &&
+             strcmp(c->station, st->name) < 0;
+    pthread_mutex_unlock(&st->claimlock);
+    return beaten;
+}
+
+// Claim the reading and hold it for the dedup window
+void dedup_hold(struct station *st, union tempdata *u, int64_t ms)
+{
+    struct pending *p = &st->pending[u->var.channel][u->var.sensor];
+    union tempdata held;
+    struct timespec now;
+    char topic[32], msg[128];
+    int ret;
+
+    if (claim_beaten(st, u, ms)) {
+        st->deduped++;
+        return;
+    }
+
+    // A window longer than the sensor's period, don't lose the older one,
+    // unless it is this reading again or another station has claimed it
+    if (!p->held) {
+        st->npending++;
+    } else if (p->raw != u->raw) {
+        held.raw = p->raw;
+        if (claim_beaten(st, &held, p->ms))
+            st->deduped++;
+        else
+            reading_publish(st, p->raw, p->ms);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    p->raw = u->raw;
+    p->ms = ms;
+    p->due = timespec_ns(&now) + st->dedup_ms * 1000000LL;
+    p->held = 1;
+
+    // A claim queued for a broker that isn't there would only be stale
+    if (!__atomic_load_n(&st->connected, __ATOMIC_ACQUIRE))
+        return;
+    snprintf(topic, sizeof(topic), "weather/claim/%02x/%u",
+             u->var.sensor, u->var.channel + 1);
+    snprintf(msg, sizeof(msg), "%lld %llu %s", (long long)ms,
+             (unsigned long long)u->raw, st->name);
+    ret = mosquitto_publish(st->mqtt, NULL, topic, strlen(msg), msg, 1, true);
+    if (ret != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Couldn't publish claim: %s\n", mosquitto_strerror(ret));
+}
+
+// Publish or drop the readings whose window is over, returns the time
+// (CLOCK_MONOTONIC nsecs) the next one is due, INT64_MAX if none
+int64_t dedup_flush(struct station *st, int64_t now)
+{
+    struct pending *p;
+    union tempdata u;
+    int64_t next = INT64_MAX;
+    int ch, id;
+
+    for (ch = 0; ch < 4 && st->npending; ch++) {
+        for (id = 0; id < 256; id++) {
+            p = &st->pending[ch][id];
+            if (!p->held)
+                continue;
+            if (p->due > now) {
+                next = p->due < next ? p->due : next;
+                continue;
+            }
+
+            u.raw = p->raw;
+            if (claim_beaten(st, &u, p->ms))
+                st->deduped++;
+            else
+                reading_publish(st, p->raw, p->ms);
+            p->held = 0;
+            st->npending--;
+        }
+    }
+    return next;
+}
+
+void parseprint(struct station *st, uint64_t buf, const struct timespec *ts)
+{
+    union tempdata u;
+    struct sensor_state *state;
+    int64_t ms = wallclock_ms(&st->clock, ts);
+    int repeat;
+
     buf<<=3; // pad from 37-bit to 40-bit (i.e. 8 bytes)
     u.raw = buf & 0xFFFFFFFFFF; // cast 64-bit input to 40-bit
 
+    // Each burst repeats the frame several times, only report it once
+    state = &st->sensors[u.var.channel][u.var.sensor];
+    repeat = sensor_heard(st, state, &u, ts);
+    if (!burst_report(state, u.raw, repeat))
+        return;
+
+    // Local readers first, they don't wait on the LCD or broker
+    shm_update(st->shm, &u, ms);
+
     // Print to stdout
-    printf("%ld: id=%02x,pow=%u,man=%u,ch=%u,temp=%.1f,rh=%u\n",
-           time(NULL), u.var.sensor, u.var.charge, u.var.manual, 
+    printf("%lld: id=%02x,pow=%u,man=%u,ch=%u,temp=%.1f,rh=%u\n",
+           (long long)ms, u.var.sensor, u.var.charge, u.var.manual, 
 	   u.var.channel + 1, ((float)u.var.celcius / 10), u.var.humidity);
 
-    // Print to LCD
-    sprintf(msg, "#%u Temp: %.1f\337C\nHumidity: %u%%",
-	   u.var.channel + 1, ((float)u.var.celcius / 10), u.var.humidity);
-    lcd_send_msg(lines, msg);
+    // Print to LCD, as the next dashboard page
+    dashboard_update(&st->dash, &u, ms / 1000);
 
-    // Print to MQTT
-    sprintf(msg, "%ld: %llu", time(NULL), u.raw);
-    ret = mosquitto_publish(mqtt, NULL, mqtttopic, strlen(msg), msg, 2, false);
-    if (ret != MOSQ_ERR_SUCCESS) {
-        mosquitto_destroy(mqtt);
-        fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
-        exit(3);
+    // Print to MQTT, unless another station has it covered
+    if (st->dedup_ms)
+        dedup_hold(st, &u, ms);
+    else
+        reading_publish(st, u.raw, ms);
+}
+
+// Finish a stats message with its part number and send it
+void stats_send(struct station *st, char *msg, int len, int part, int parts)
+{
+    int ret;
+
+    len += snprintf(msg + len, STATS_TRAILER, ";part=%d/%d", part, parts);
+    ret = mosquitto_publish(st->mqtt, NULL, st->statstopic, len, msg, 2, false);
+    if (ret != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Couldn't publish stats: %s\n", mosquitto_strerror(ret));
+}
+
+// One sensor's counters, ";3f/1:ok=..,bursts=..,...", 0 if it has none
+int stats_entry(struct sensor_state *state, int ch, int id, char *entry, int size)
+{
+    int n;
+
+    if (!state->bursts)
+        return 0;
+    n = snprintf(entry, size,
+                 ";%02x/%u:ok=%u,bursts=%u,rep=%u,abort=%u,miss=%u,"
+                 "period=%d,drift=%lld,charge=%x",
+                 id, ch + 1, state->accepted, state->bursts,
+                 state->last_burst_frames, state->aborted,
+                 state->missed, state->period_ms,
+                 (long long)(state->periods ?
+                             state->drift_ms / state->periods : 0),
+                 state->charge);
+    return n < size ? n : 0;
+}
+
+// Publish the reception counters, e.g.
+// 1690000000000: edges=..,glitch=..,start=..,gap=..,count=..,ok=..,dedup=..;3f/1:ok=..,...;part=1/2
+// split over as many messages as the sensors need, each one parseable on
+// its own: the same stamp and station counters, whole sensor entries and
+// which part of how many it is
+void stats_publish(struct station *st)
+{
+    struct decoder_stats *ds = &st->dec.stats;
+    struct sensor_state *state;
+    struct timespec now;
+    char msg[1024], entry[160];
+    int ch, id, len, head, n, pass, part, parts = 0;
+    int64_t ms;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ms = timespec_ns(&now) / 1000000;
+
+    // A battery swap gives a sensor a new UID, forget those gone quiet
+    for (ch = 0; ch < 4; ch++) {
+        for (id = 0; id < 256; id++) {
+            state = &st->sensors[ch][id];
+            if (state->bursts && ms - state->heard_ms >
+                STATS_EXPIRE * ((ch + 1) * 10 + 49) * 1000LL)
+                memset(state, 0, sizeof(*state));
+        }
     }
 
-    // Wait for next transmission
-    sleep((u.var.channel + 1) * 10 + 49);
+    // Nothing queues up while the broker is away, the counters carry on
+    if (!__atomic_load_n(&st->connected, __ATOMIC_ACQUIRE))
+        return;
+
+    head = snprintf(msg, sizeof(msg),
+                    "%lld: edges=%llu,glitch=%llu,start=%llu,gap=%llu,count=%llu,ok=%llu,dedup=%llu,lost=%llu",
+                    (long long)ms,
+                    (unsigned long long)ds->edges,
+                    (unsigned long long)ds->glitches,
+                    (unsigned long long)ds->started,
+                    (unsigned long long)ds->aborted_gap,
+                    (unsigned long long)ds->aborted_count,
+                    (unsigned long long)ds->accepted,
+                    (unsigned long long)st->deduped,
+                    (unsigned long long)st->backlog_lost);
+
+    // Count the parts first, then send them
+    for (pass = 0; pass < 2; pass++) {
+        part = 1;
+        len = head;
+        for (ch = 0; ch < 4; ch++) {
+            for (id = 0; id < 256; id++) {
+                n = stats_entry(&st->sensors[ch][id], ch, id, entry, sizeof(entry));
+                if (!n)
+                    continue;
+                if (len + n >= sizeof(msg) - STATS_TRAILER) {
+                    if (pass)
+                        stats_send(st, msg, len, part, parts);
+                    part++;
+                    len = head;
+                }
+                memcpy(msg + len, entry, n + 1);
+                len += n;
+            }
+        }
+        if (pass)
+            stats_send(st, msg, len, part, parts);
+        parts = part;
+    }
+}
+
+// One read's worth of rising edges, as the kernel stamped them: drop
+// spikes, decode the rest as one batch and report what it ends. The
+// recorder gets the batch as read, spikes and all, with what the filter
+// and the decoder made of it.
+void station_batch(struct station *st, const int64_t *edges, int n)
+{
+    int64_t stamps[DECODE_BATCH];
+    uint64_t frames[DECODE_FRAMES], mask;
+    uint8_t sym[DECODE_BATCH];
+    int at[DECODE_FRAMES];
+    struct timespec ts;
+    int i, kept, found;
+
+    memcpy(stamps, edges, n * sizeof(*stamps));
+    kept = glitch_filter(&st->dec, stamps, n, &mask);
+    found = decode_batch(&st->dec, stamps, kept, frames, at, sym);
+    if (st->flight)
+        auriol_flight_record(st->flight, edges, n, mask, sym, frames, at, found);
+    if (found && !st->decoded) {
+        st->decoded = 1;
+        printf("First frame decoded %ld ms after start\n", ms_since(&st->started));
+    }
+    for (i = 0; i < found; i++) {
+        ns_timespec(stamps[at[i]], &ts);
+        parseprint(st, frames[i], &ts);
+    }
 }
 
-void main(void)
+void main(int argc, char **argv)
 {
     int gpios[] = { 22, 23, 24, 25, 18, 17, 4 };
-    struct timespec timeout = { 80, 0 }; // maximum time between messages
-    struct timespec timegap, last_event_time = { 0, 0 }; 
+    struct timespec maxtimeout = { 80, 0 }; // maximum time between messages
+    struct timespec timeout, ts;
     struct gpiod_chip *chip;
     struct gpiod_line_request_config config;
     struct gpiod_line *tmpline, *rxline;
     struct gpiod_line_bulk lines;
-    struct gpiod_line_event events[16];
+    struct gpiod_line_event events[DECODE_BATCH];
+    int64_t edges[DECODE_BATCH];
     char mqtthost[] = "localhost";
-    char mqtttopic[] = "weather/raw";
     int mqttport = 1883;
     int mqtttimeout = 60;
-    struct mosquitto *mqtt;
-    int i, ret, bitcount;
-    uint64_t buf;
+    static struct station st;
+    struct sigaction sa;
+    sigset_t usr1;
+    time_t now;
+    int64_t due;
+    int i, ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &st.started);
+
+    st.dedup_ms = argc > 1 ? atoi(argv[1]) : 0;
+    if (st.dedup_ms < 0) {
+        fprintf(stderr, "usage: %s [dedup window ms]\n", argv[0]);
+        exit(1);
+    }
+    pthread_mutex_init(&st.claimlock, NULL);
+
+#ifdef AURIOL_NO_HEAP
+    fixed_footprint_init();
+#endif
 
     // Tell the gpiod that we are looking for a LOW>HIGH event
     config.request_type = GPIOD_LINE_REQUEST_EVENT_RISING_EDGE;
@@ -231,6 +1038,10 @@ void main(void)
         exit(3);
     }
 
+    // From here the kernel timestamps and queues edges for us, everything
+    // else has to be quick (or happen in the background) until we read them
+    printf("Receiving %ld ms after start\n", ms_since(&st.started));
+
     // I couldn't get the bulk thing working - this does work however
     for (i=0;i<6;i++) {
         tmpline = gpiod_line_bulk_get_line(&lines, i);
@@ -241,39 +1052,118 @@ void main(void)
         }
     }
 
+    // Receiver-specific timings, if this station has been calibrated
+    decoder_init(&st.dec);
+    if (pulse_windows_load(PULSE_CONF, &st.dec.win) == 0)
+        printf("Loaded pulse windows from %s\n", PULSE_CONF);
+
+    st.shm = shm_create();
+    wallclock_calibrate(&st.clock);
+    st.flight = flight_create(&st.dec.win);
+    if (st.flight)
+        st.flight->h.wall_offset = st.clock.offset;
+
+    // Dump the flight recorder on request, interrupting the wait for edges
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = cb_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // Topics carry the hostname so an aggregator can tell stations apart
+    strcpy(st.name, "station");
+    gethostname(st.name, sizeof(st.name) - 1);
+    snprintf(st.rawtopic, sizeof(st.rawtopic), "weather/%s/raw", st.name);
+    snprintf(st.statstopic, sizeof(st.statstopic), "weather/%s/stats", st.name);
+
     mosquitto_lib_init();
-    mqtt = mosquitto_new(NULL, true, NULL);
-    if(mqtt == NULL) {
+    st.mqtt = mosquitto_new(NULL, true, &st);
+    if(st.mqtt == NULL) {
         fprintf(stderr, "Error initialising MQTT\n");
         exit(1);
     }
 
-    mosquitto_connect_callback_set(mqtt, cb_connect);
-    mosquitto_publish_callback_set(mqtt, cb_publish);
+    mosquitto_connect_callback_set(st.mqtt, cb_connect);
+    mosquitto_disconnect_callback_set(st.mqtt, cb_disconnect);
+    mosquitto_publish_callback_set(st.mqtt, cb_publish);
+    mosquitto_message_callback_set(st.mqtt, cb_message);
 
-    ret = mosquitto_connect(mqtt, mqtthost, mqttport, mqtttimeout);
+    // The broker box may still be booting after a power cut, so connect
+    // in the background and keep retrying, backing off from 1s to 60s
+    mosquitto_reconnect_delay_set(st.mqtt, 1, 60, true);
+    ret = mosquitto_connect_async(st.mqtt, mqtthost, mqttport, mqtttimeout);
+    if (ret != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Broker not reachable yet (%s), retrying\n",
+                mosquitto_strerror(ret));
 
+    // The MQTT thread leaves SIGUSR1 to this one
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    ret = mosquitto_loop_start(st.mqtt);
+    pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
     if (ret != MOSQ_ERR_SUCCESS) {
-        mosquitto_destroy(mqtt);
-        fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
+        mosquitto_destroy(st.mqtt);
+        fprintf(stderr, "Couldn't start MQTT thread: %s\n", mosquitto_strerror(ret));
         exit(2);
     }
 
-    ret = mosquitto_loop_start(mqtt);
-    if (ret != MOSQ_ERR_SUCCESS) {
-        mosquitto_destroy(mqtt);
-        fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
-        exit(2);
-    }
-
-    // Prepare the LCD
-    lcd_init_4bit_16x2(&lines);
-    lcd_send_msg(&lines, "Awaiting Reading");
+    // Prepare the LCD, written out a little at a time by lcd_step()
+    lcd_init_4bit_16x2(&st.lcd, lcd_line_set, &lines);
+    lcd_send_msg(&st.lcd, "Awaiting Reading");
 
     // Go find a tranmission
     for(;;) {
+        // Keep the display moving, it never holds up the receiver
+        lcd_step(&st.lcd);
+        dashboard_tick(&st.dash, &st.lcd, time(NULL));
+
+        // Follow the wall clock, edges carry monotonic timestamps
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if (timespec_ns(&ts) >= st.clock.next) {
+            wallclock_calibrate(&st.clock);
+            if (st.flight)
+                st.flight->h.wall_offset = st.clock.offset;
+        }
+
+        // Readings whose dedup window is over
+        due = st.npending ? dedup_flush(&st, timespec_ns(&ts)) : INT64_MAX;
+
+        // Readings held while the broker was away
+        if (st.backlog_tail != st.backlog_head)
+            backlog_flush(&st);
+
+        // Reception telemetry, every few minutes
+        if (time(NULL) >= st.stats_next) {
+            if (st.stats_next)
+                stats_publish(&st);
+            st.stats_next = time(NULL) + STATS_INTERVAL;
+        }
+
+        // Flight recorder, on request or when reception falls away
+        if (flight_requested) {
+            flight_requested = 0;
+            flight_dump(&st, "as requested");
+        }
+        if (time(NULL) >= st.flight_next) {
+            if (st.flight_next)
+                flight_check(&st, time(NULL));
+            st.flight_next = time(NULL) + FLIGHT_CHECK;
+        }
+
+        // Sleep until the next edge or until the display needs attention
+        timeout = maxtimeout;
+        if (lcd_busy(&st.lcd))
+            lcd_timeout(&st.lcd, &timeout);
+        else if (st.dash.count > 0) {
+            now = time(NULL);
+            timeout.tv_sec = st.dash.next > now ? st.dash.next - now : 0;
+        }
+        if (due - timespec_ns(&ts) < timespec_ns(&timeout))
+            ns_timespec(due - timespec_ns(&ts), &timeout);
+
         // Wait for a rising edge...
         ret = gpiod_line_event_wait(rxline, &timeout);
+        if (ret < 0 && errno == EINTR)
+            continue;
         if (ret < 0) {
             fprintf(stderr, "failure waiting for line event\n");
 	    exit(4);
@@ -290,38 +1180,10 @@ void main(void)
 	    exit(5);
 	}
 
-	// Cycle through the LOW>HIGH events
-        for(i = 0; i < ret; i++) {
-            // Calculate the time between this event and last event
-            timesecdiff(&last_event_time, &events[i].ts, &timegap);
-            last_event_time = events[i].ts;
-
-            // No point doing anything if it was more than a second
-            if (timegap.tv_sec == 0) {
-                // Try to round up the nanosecs to the nearest 1.0 ms
-		switch ((timegap.tv_nsec - 460000) / 100000) {
-		case 10: 
-		    // 1.0 msec == 0 bit (Keep going)
-		    buf<<=1;
-                    bitcount++;
-                    continue;
-		case 20:
-		    // 2.0 msec == 1 bit (Keep going)
-		    buf<<=1;
-		    buf |= 1;
-                    bitcount++;
-                    continue;
-		case 40:
-		    // 4.0 msec == sync bit (EOM)
-                    if (bitcount == 37)  {
-                        parseprintwait(&lines, mqtt, buf);
-		    }
-                }
-            } 
-	    // Reset, start again
-            bitcount = 0;
-	    buf = 0;
-        }
+	// Decode the LOW>HIGH events as one batch
+        for(i = 0; i < ret; i++)
+            edges[i] = timespec_ns(&events[i].ts);
+        station_batch(&st, edges, ret);
     }        
 
     // Clean up - should really use signals here
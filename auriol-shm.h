@@ -0,0 +1,126 @@
+/*
+   Auriol Weather Station - shared memory table of latest readings
+
+   The station keeps a POSIX shared memory segment (AURIOL_SHM_NAME) with
+   one fixed slot per sensor UID and channel. Local consumers (loggers,
+   kiosk UIs, ...) map it read-only and never touch the MQTT broker.
+
+   Each slot is guarded by a seqlock: the station makes `seq` odd, writes
+   the slot, then makes `seq` even again. Readers retry until they see the
+   same even `seq` before and after copying the slot. After every update
+   the station bumps `generation` and wakes any futex waiters on it, so
+   readers can sleep until something changes.
+
+   Usage (reader):
+     struct auriol_shm *shm = auriol_shm_open();
+     uint32_t gen = auriol_shm_generation(shm);
+     for (;;) {
+         auriol_shm_wait(shm, gen, NULL);
+         gen = auriol_shm_generation(shm);
+         if (auriol_shm_read(shm, sensor, channel, &entry)) ...
+     }
+
+   Link with -lrt on glibc older than 2.34.
+*/
+
+#ifndef AURIOL_SHM_H
+#define AURIOL_SHM_H
+
+#include <stdint.h>       // uint*_t
+#include <string.h>       // memcpy()
+#include <time.h>         // struct timespec
+#include <fcntl.h>        // O_* flags
+#include <unistd.h>       // close(), syscall()
+#include <sys/mman.h>     // shm_open(), mmap()
+#include <sys/syscall.h>  // SYS_futex
+#include <linux/futex.h>  // FUTEX_WAIT, FUTEX_WAKE
+
+#define AURIOL_SHM_NAME     "/auriol"
+#define AURIOL_SHM_MAGIC    0x4155524f // "AURO"
+#define AURIOL_SHM_VERSION  2
+#define AURIOL_SHM_SENSORS  256 // 8-bit UID
+#define AURIOL_SHM_CHANNELS 4   // 2-bit channel field
+
+struct auriol_shm_entry {
+    uint32_t seq;      // Seqlock, odd while the station is writing
+    uint8_t sensor;
+    uint8_t channel;   // As sent, i.e. 0 = channel 1
+    uint8_t charge;
+    uint8_t manual;
+    int16_t celcius;   // Tenths of a degree
+    uint8_t humidity;
+    uint8_t valid;     // Zero until the slot has been written once
+    int64_t time_ms;   // Wall-clock milliseconds of the reading's sync edge
+    uint64_t raw;      // 40-bit frame as published to MQTT
+} __attribute__((aligned(32)));
+
+struct auriol_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation; // Bumped after every update, futex word
+    uint32_t reserved;
+    struct auriol_shm_entry entry[AURIOL_SHM_CHANNELS][AURIOL_SHM_SENSORS];
+};
+
+// Map the station's table read-only, NULL (with errno set) on failure
+static inline struct auriol_shm *auriol_shm_open(void)
+{
+    struct auriol_shm *shm;
+    int fd;
+
+    fd = shm_open(AURIOL_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    if (shm->magic != AURIOL_SHM_MAGIC || shm->version != AURIOL_SHM_VERSION) {
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+
+    return shm;
+}
+
+static inline void auriol_shm_close(struct auriol_shm *shm)
+{
+    munmap(shm, sizeof(*shm));
+}
+
+static inline uint32_t auriol_shm_generation(const struct auriol_shm *shm)
+{
+    return __atomic_load_n(&shm->generation, __ATOMIC_ACQUIRE);
+}
+
+// Consistent snapshot of one slot, returns 1 if the slot holds a reading
+static inline int auriol_shm_read(const struct auriol_shm *shm, int sensor,
+                                  int channel, struct auriol_shm_entry *out)
+{
+    const struct auriol_shm_entry *e = &shm->entry[channel & 3][sensor & 0xff];
+    uint32_t s1, s2;
+
+    do {
+        s1 = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, e, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    } while ((s1 & 1) || s1 != s2);
+
+    return out->valid;
+}
+
+// Sleep until the generation moves on from `gen` (or timeout/signal)
+static inline int auriol_shm_wait(const struct auriol_shm *shm, uint32_t gen,
+                                  const struct timespec *timeout)
+{
+    if (auriol_shm_generation(shm) != gen)
+        return 0;
+
+    return syscall(SYS_futex, &shm->generation, FUTEX_WAIT, gen,
+                   timeout, NULL, 0);
+}
+
+#endif
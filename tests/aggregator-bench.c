@@ -0,0 +1,190 @@
+/*
+   Aggregator throughput, messages/sec and per thread, as receivers and
+   workers are added.
+
+   The broker is replaced by a stand-in. Each receiver is a thread that
+   plays one connection's network thread, handing its share of pre-built
+   frames (dealt round robin, as a shared subscription does) from a few
+   hundred stations to cb_message(). mosquitto_publish() only counts the
+   batches. Every station sends each frame twice so the dedup path gets
+   exercised as well. A receiver waits while its frame's worker queue is
+   full, as the broker would hold back; any drops are reported and not
+   counted as throughput.
+
+   Left out: the broker itself, and libmosquitto reading packets off the
+   socket before cb_message(). That is per receiver, so it adds to each
+   receiver's cost but doesn't change how receivers scale. The first
+   series keeps one receiver, as a single connection would.
+
+   gcc -O2 -o aggregator-bench aggregator-bench.c -lmosquitto -lpthread
+   Usage: aggregator-bench [messages] [stations]
+*/
+
+#include <sched.h> // sched_yield()
+
+#define main aggregator_main
+#include "../auriol-aggregator.c"
+#undef main
+
+static uint64_t published_batches, published_bytes;
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+                      int payloadlen, const void *payload, int qos, bool retain) {
+    __atomic_add_fetch(&published_batches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&published_bytes, payloadlen, __ATOMIC_RELAXED);
+    return MOSQ_ERR_SUCCESS;
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now, gap;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timesecdiff(start, &now, &gap);
+    return gap.tv_sec + gap.tv_nsec / 1e9;
+}
+
+static uint64_t processed(struct aggregator *agg) {
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < agg->nworkers; i++)
+        n += __atomic_load_n(&agg->shards[i].received, __ATOMIC_RELAXED);
+    return n;
+}
+
+static uint64_t dropped(struct aggregator *agg) {
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < agg->nworkers; i++)
+        n += __atomic_load_n(&agg->shards[i].dropped, __ATOMIC_RELAXED);
+    return n;
+}
+
+struct benchmsg {
+    char topic[32];
+    int namelen; // weather/<name>/raw
+    int len;
+    char payload[32];
+};
+
+// Every frame twice, stations take turns, three channels each
+static struct benchmsg *generate(long messages, int stations) {
+    struct benchmsg *msgs;
+    union tempdata u;
+    long n;
+
+    msgs = calloc(messages, sizeof(*msgs));
+    if (!msgs) {
+        printf("unable to allocate %ld messages\n", messages);
+        exit(1);
+    }
+
+    for (n = 0; n < messages; n++) {
+        u.raw = 0;
+        u.var.sensor = (n / 2) % 251;
+        u.var.channel = (n / 2) % 3;
+        u.var.celcius = (n / 2) % 400 - 100;
+        u.var.humidity = 40 + (n / 2) % 50;
+        u.var.charge = 1;
+        msgs[n].namelen = sprintf(msgs[n].topic, "weather/station%ld/raw",
+                                  (n / 2) % stations) - 12;
+        msgs[n].len = sprintf(msgs[n].payload, "%lld: %llu",
+                              1600000000000LL + n / 2 * 1000,
+                              (unsigned long long)u.raw);
+    }
+    return msgs;
+}
+
+struct receiver {
+    pthread_t thread;
+    struct aggregator *agg;
+    struct benchmsg *msgs;
+    long messages;
+    int index, nreceivers;
+};
+
+// One connection's network thread, every nreceivers-th frame
+static void *receive(void *arg) {
+    struct receiver *r = arg;
+    struct mosquitto_message msg;
+    struct shard *shard;
+    long n;
+
+    memset(&msg, 0, sizeof(msg));
+    for (n = r->index; n < r->messages; n += r->nreceivers) {
+        // A broker holds back from a slow subscriber, so wait for room
+        // rather than measure the drops
+        shard = &r->agg->shards[station_hash(r->msgs[n].topic + 8,
+                                             r->msgs[n].namelen) % r->agg->nworkers];
+        while (__atomic_load_n(&shard->head, __ATOMIC_RELAXED) -
+               __atomic_load_n(&shard->tail, __ATOMIC_RELAXED) >= SHARD_QUEUE - 1)
+            sched_yield();
+        msg.topic = r->msgs[n].topic;
+        msg.payload = r->msgs[n].payload;
+        msg.payloadlen = r->msgs[n].len;
+        cb_message(r->agg->mqtt[r->index], r->agg, &msg);
+    }
+    return NULL;
+}
+
+static void run(int nreceivers, int nworkers, struct benchmsg *msgs, long messages) {
+    static struct aggregator agg;
+    static struct receiver receivers[MAX_RECEIVERS];
+    struct timespec start;
+    uint64_t done, drops;
+    double secs;
+    int i;
+
+    agg.nreceivers = nreceivers;
+    for (i = 0; i < nreceivers; i++)
+        agg.mqtt[i] = (struct mosquitto *)(long)(i + 1);
+    agg_start(&agg, nworkers);
+    published_batches = published_bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nreceivers; i++) {
+        receivers[i] = (struct receiver){ .agg = &agg, .msgs = msgs,
+            .messages = messages, .index = i, .nreceivers = nreceivers };
+        if (pthread_create(&receivers[i].thread, NULL, receive, &receivers[i]) != 0) {
+            printf("unable to start receiver\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nreceivers; i++)
+        pthread_join(receivers[i].thread, NULL);
+    while (processed(&agg) + dropped(&agg) < messages)
+        sched_yield();
+    secs = elapsed(&start);
+    done = processed(&agg);
+    drops = dropped(&agg);
+
+    printf("%2d receivers %2d workers: %9.0f msgs/sec, %9.0f msgs/sec/thread, "
+           "%llu dropped, %llu batches\n",
+           nreceivers, nworkers, done / secs, done / secs / (nreceivers + nworkers),
+           (unsigned long long)drops,
+           (unsigned long long)__atomic_load_n(&published_batches, __ATOMIC_RELAXED));
+    agg_stop(&agg);
+
+    // Every frame handled exactly once, whichever receiver queued it
+    if (done + drops != messages) {
+        printf("FAIL: %llu frames processed\n", (unsigned long long)done);
+        exit(1);
+    }
+}
+
+void main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 1000000;
+    int stations = argc > 2 ? atoi(argv[2]) : 300;
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    struct benchmsg *msgs;
+    int n;
+
+    msgs = generate(messages, stations);
+
+    printf("%ld messages from %d stations, %d cores\n", messages, stations, cores);
+    for (n = 1; n <= cores && n <= MAX_WORKERS; n *= 2)
+        run(1, n, msgs, messages);
+    for (n = 2; 2 * n <= cores && n <= MAX_RECEIVERS; n *= 2)
+        run(n, n, msgs, messages);
+}
@@ -0,0 +1,240 @@
+/*
+   Counts heap allocations on the station's steady-state path, and checks
+   the fixed footprint build never grows the heap.
+
+   The station is compiled in with its main() renamed and the GPIO and
+   MQTT calls replaced by stand-ins. Synthetic bursts from three sensors,
+   with spikes after some of their edges, are fed through station_batch()
+   a kernel FIFO's worth at a time, as the station's receive loop does:
+   glitch filter, batch decode, flight recorder, stdout, shared memory,
+   the LCD dashboard, and dedup with claims from another station. Now and
+   then the broker goes away for a while: readings wait in the station's
+   backlog, which overflows, and go out once it is back.
+
+   Two checks:
+     - after a warm-up, the station's own code makes no allocation at all
+     - from fixed_footprint_init() on, the program break never moves
+
+   The publish path is not covered by the first check: mosquitto_publish()
+   is a stand-in, there is no broker here. It allocates and frees a packet
+   per message, as libmosquitto does, and that is what the second check
+   is for: the packets must come out of the heap reserved at startup.
+   Only -DAURIOL_NO_HEAP reserves it, built without the flag the second
+   check fails.
+
+   gcc -DAURIOL_NO_HEAP -o alloc-count-test alloc-count-test.c -lgpiod -lmosquitto -lrt -lpthread
+*/
+
+#define main station_main
+#include "../auriol-lcd-mqtt.c"
+#undef main
+
+#define KFIFO 16 // Events the kernel holds per line, one read at most
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs;
+static volatile int in_broker; // The stand-in's own allocations aren't counted
+
+void *malloc(size_t size) {
+    allocs += !in_broker;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocs += !in_broker;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs += !in_broker;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+// Stand-ins for the hardware and broker
+static struct gpiod_line *fake_line = (struct gpiod_line *)1;
+static unsigned long publishes, claims;
+
+struct gpiod_line *gpiod_line_bulk_get_line(struct gpiod_line_bulk *bulk,
+                                            unsigned int index) {
+    return fake_line;
+}
+
+int gpiod_line_set_value(struct gpiod_line *line, int value) {
+    return 0;
+}
+
+// A packet per message, freed once sent, like libmosquitto
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+                      int payloadlen, const void *payload, int qos, bool retain) {
+    char *packet;
+
+    in_broker = 1;
+    packet = malloc(strlen(topic) + payloadlen + 16);
+    in_broker = 0;
+    if (!packet)
+        return MOSQ_ERR_NOMEM;
+    memcpy(packet, payload, payloadlen);
+    free(packet);
+
+    if (strncmp(topic, "weather/claim/", 14) == 0)
+        claims++;
+    else
+        publishes++;
+    return MOSQ_ERR_SUCCESS;
+}
+
+static struct station st;
+static struct auriol_shm shm;
+static unsigned long outages;
+static int64_t clock_ns = 1000000000000LL;
+static int64_t fifo[KFIFO];
+static int queued;
+
+// The station reads whatever the kernel queued, a full FIFO at most
+static void fifo_read(void) {
+    if (queued)
+        station_batch(&st, fifo, queued);
+    queued = 0;
+}
+
+static void fifo_edge(int64_t ns) {
+    fifo[queued++] = ns;
+    if (queued == KFIFO)
+        fifo_read();
+}
+
+static void edge(long gap, int spike) {
+    clock_ns += gap;
+    fifo_edge(clock_ns);
+    if (spike)
+        fifo_edge(clock_ns + 100000);
+}
+
+// One transmission: the frame six times over, each ending in sync
+static void burst(uint8_t sensor, uint8_t channel, int16_t celcius) {
+    struct mosquitto_message msg;
+    char claim[64];
+    union tempdata u;
+    uint64_t bits;
+    int r, i;
+
+    u.raw = 0;
+    u.var.sensor = sensor;
+    u.var.channel = channel;
+    u.var.celcius = celcius;
+    u.var.humidity = 50 + channel;
+    u.var.unknown = 0xf;
+    u.var.charge = 1;
+    bits = u.raw >> 3;
+
+    // Another station sometimes gets there first
+    if (sensor % 2) {
+        snprintf(claim, sizeof(claim), "%lld %llu %s",
+                 (long long)((clock_ns + 4500000) / 1000000),
+                 (unsigned long long)u.raw, sensor % 4 == 1 ? "aardvark" : "bravo");
+        msg.topic = "weather/claim/00/1";
+        msg.payload = claim;
+        msg.payloadlen = strlen(claim);
+        cb_message(st.mqtt, &st, &msg);
+    }
+
+    edge(4500000, 0);
+    for (r = 0; r < 6; r++) {
+        for (i = 36; i >= 0; i--)
+            edge((bits >> i) & 1 ? 2500000 : 1500000, i % 11 == 0);
+        edge(4500000, 0);
+    }
+    fifo_read();
+
+    // What the rest of the receive loop does between reads
+    dedup_flush(&st, INT64_MAX - 1);
+    while (lcd_busy(&st.lcd))
+        lcd_step(&st.lcd);
+    st.dash.next = 0;
+    dashboard_tick(&st.dash, &st.lcd, time(NULL));
+    while (lcd_busy(&st.lcd))
+        lcd_step(&st.lcd);
+}
+
+void main(void) {
+    struct gpiod_line_bulk lines;
+    void *brk_start;
+    int n;
+
+    // The station's ring is shared memory, not heap
+    st.flight = mmap(NULL, sizeof(*st.flight), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (st.flight == MAP_FAILED) {
+        printf("unable to map flight recorder\n");
+        exit(1);
+    }
+
+#ifdef AURIOL_NO_HEAP
+    fixed_footprint_init();
+#endif
+    brk_start = sbrk(0);
+
+    decoder_init(&st.dec);
+    st.flight->h.win = st.dec.win;
+    st.shm = &shm;
+    st.dedup_ms = 500;
+    strcpy(st.name, "alpha");
+    cb_connect(st.mqtt, &st, 0);
+    snprintf(st.rawtopic, sizeof(st.rawtopic), "weather/%s/raw", st.name);
+    snprintf(st.statstopic, sizeof(st.statstopic), "weather/%s/stats", st.name);
+    pthread_mutex_init(&st.claimlock, NULL);
+    lcd_init_4bit_16x2(&st.lcd, lcd_line_set, &lines);
+
+    // Warm up, stdio and the like may set themselves up on first use
+    for (n = 0; n < 3; n++) {
+        burst(0x3f, n, 200 + n);
+        clock_ns += 60000000000LL;
+    }
+    stats_publish(&st);
+
+    allocs = 0;
+    for (n = 0; n < 3000; n++) {
+        // Long enough for the backlog to overflow
+        if (n % 1000 == 100) {
+            cb_disconnect(st.mqtt, &st, 1);
+            outages++;
+        }
+        if (n % 1000 == 100 + 2 * MQTT_BACKLOG) {
+            cb_connect(st.mqtt, &st, 0);
+            backlog_flush(&st);
+        }
+        burst(0x10 + n % 7, n % 3, n % 400 - 100);
+        clock_ns += 20000000000LL;
+        if (n % 100 == 0)
+            stats_publish(&st);
+    }
+
+    printf("%lu frames accepted, %lu glitches dropped, %lu readings published, "
+           "%lu claims, %lu deduped, %lu lost over %lu outages, "
+           "%lu allocations, heap grew %ld bytes\n",
+           (unsigned long)st.dec.stats.accepted,
+           (unsigned long)st.dec.stats.glitches, publishes, claims,
+           (unsigned long)st.deduped, (unsigned long)st.backlog_lost, outages, allocs,
+           (long)((char *)sbrk(0) - (char *)brk_start));
+    if (allocs != 0) {
+        printf("FAIL: steady state allocated\n");
+        exit(1);
+    }
+    if (!st.backlog_lost || st.backlog_head != st.backlog_tail) {
+        printf("FAIL: backlog didn't overflow or wasn't flushed\n");
+        exit(1);
+    }
+    if (sbrk(0) != brk_start) {
+        printf("FAIL: heap grew after startup\n");
+        exit(1);
+    }
+    printf("PASS\n");
+}
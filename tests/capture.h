@@ -0,0 +1,44 @@
+/*
+   Edge captures for the decoder tests: "sec.nsec" lines, as written by
+   libgpiod-detect-rising-edge and flight-dump -e. Other lines are skipped.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>  // fopen(), printf()
+#include <stdint.h> // int64_t
+#include <stdlib.h> // realloc(), exit()
+
+// Load a capture as nsecs, exits on failure
+static inline int64_t *load_capture(const char *path, long *n) {
+    int64_t *ts = NULL;
+    long sec, nsec, size = 0;
+    char line[128];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        printf("unable to open %s\n", path);
+        exit(1);
+    }
+
+    *n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%ld.%ld", &sec, &nsec) != 2)
+            continue;
+        if (*n == size) {
+            size = size ? size * 2 : 65536;
+            ts = realloc(ts, size * sizeof(*ts));
+            if (!ts) {
+                printf("unable to allocate trace\n");
+                exit(1);
+            }
+        }
+        ts[(*n)++] = sec * 1000000000LL + nsec;
+    }
+    fclose(f);
+    return ts;
+}
+
+#endif
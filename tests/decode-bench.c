@@ -0,0 +1,153 @@
+/*
+   Decoder throughput, one edge at a time against batched classification.
+
+   Replays a capture from libgpiod-detect-rising-edge (its "sec.nsec"
+   lines), or a synthetic trace of bursts buried in RF noise, through
+   decode_edge() and through glitch_filter() + decode_batch(), checks both
+   find the same frames and reports edges/sec for each, then again with
+   the station's flight recorder (auriol-flight.h) logging every edge.
+
+   gcc -O2 -o decode-bench decode-bench.c                (plain C)
+   gcc -O2 -mavx2 -o decode-bench decode-bench.c         (x86 AVX2)
+   gcc -O2 -mfpu=neon -o decode-bench decode-bench.c     (ARM NEON)
+   Usage: decode-bench [capture]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../auriol-flight.h"
+#include "capture.h"
+
+#define SYNTH_EDGES 20000000
+
+// Bursts of six frames every few seconds, random noise in between
+static int64_t *synthesize(long *n) {
+    int64_t *ts, t = 1000000000LL;
+    uint64_t bits = 0x123456789ULL;
+    long i = 0;
+    int r, b;
+
+    ts = malloc(SYNTH_EDGES * sizeof(*ts));
+    if (!ts) {
+        printf("unable to allocate trace\n");
+        exit(1);
+    }
+
+    srand(1);
+    while (i < SYNTH_EDGES - 300) {
+        if (rand() % 4 == 0) {
+            for (r = 0; r < 6; r++) {
+                for (b = 36; b >= 0; b--)
+                    ts[i++] = t += ((bits >> b) & 1 ? 2500000 : 1500000)
+                                   + rand() % 40000 - 20000;
+                ts[i++] = t += 4500000 + rand() % 40000 - 20000;
+            }
+            bits = (bits * 6364136223846793005ULL + 1) & 0x1FFFFFFFFFULL;
+        } else {
+            for (r = 0; r < 200; r++)
+                ts[i++] = t += rand() % 8 ? rand() % 900000 + 50000
+                                          : rand() % 6000000 + 1000;
+        }
+    }
+
+    *n = i;
+    return ts;
+}
+
+static double seconds(struct timespec *start) {
+    struct timespec now, gap;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timesecdiff(start, &now, &gap);
+    return gap.tv_sec + gap.tv_nsec / 1e9;
+}
+
+void main(int argc, char **argv) {
+    struct decoder one, batch;
+    struct timespec start, ts;
+    uint64_t frame, frames[DECODE_FRAMES], sum_one = 0, sum_batch = 0;
+    int at[DECODE_FRAMES];
+    int64_t *trace, stamps[DECODE_BATCH];
+    long n, i;
+    int found, kept, read, j;
+    double secs_one, secs_batch, secs_rec;
+    struct auriol_flight *fl;
+    uint64_t r, rec;
+    uint64_t mask;
+    uint8_t sym[DECODE_BATCH];
+    long m;
+
+    trace = argc > 1 ? load_capture(argv[1], &n) : synthesize(&n);
+
+    decoder_init(&one);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        ts.tv_sec = trace[i] / 1000000000LL;
+        ts.tv_nsec = trace[i] % 1000000000LL;
+        if (decode_edge(&one, &ts, &frame))
+            sum_one += frame;
+    }
+    secs_one = seconds(&start);
+
+    // Same reads as the station makes, a kernel buffer's worth at a time
+    decoder_init(&batch);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i += DECODE_BATCH) {
+        kept = n - i < DECODE_BATCH ? n - i : DECODE_BATCH;
+        memcpy(stamps, trace + i, kept * sizeof(*stamps));
+        kept = glitch_filter(&batch, stamps, kept, NULL);
+        found = decode_batch(&batch, stamps, kept, frames, at, NULL);
+        for (j = 0; j < found; j++)
+            sum_batch += frames[j];
+    }
+    secs_batch = seconds(&start);
+
+    // The same again, logging to an (anonymous) flight recorder ring
+    fl = calloc(1, sizeof(*fl));
+    if (!fl) {
+        printf("unable to allocate flight recorder\n");
+        exit(1);
+    }
+    decoder_init(&batch);
+    fl->h.win = batch.win;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i += DECODE_BATCH) {
+        read = n - i < DECODE_BATCH ? n - i : DECODE_BATCH;
+        memcpy(stamps, trace + i, read * sizeof(*stamps));
+        kept = glitch_filter(&batch, stamps, read, &mask);
+        found = decode_batch(&batch, stamps, kept, frames, at, sym);
+        auriol_flight_record(fl, trace + i, read, mask, sym, frames, at, found);
+    }
+    secs_rec = seconds(&start);
+
+    printf("%ld edges, %llu glitches, %llu frames\n", n,
+           (unsigned long long)one.stats.glitches,
+           (unsigned long long)one.stats.accepted);
+    printf("per edge: %8.1f Medges/sec\n", n / secs_one / 1e6);
+    printf("batched:  %8.1f Medges/sec\n", n / secs_batch / 1e6);
+    printf("recorded: %8.1f Medges/sec, %.1f ns/edge for the recorder\n",
+           n / secs_rec / 1e6, (secs_rec - secs_batch) / n * 1e9);
+
+    if (one.stats.accepted != batch.stats.accepted || sum_one != sum_batch ||
+        one.stats.started != batch.stats.started ||
+        one.stats.glitches != batch.stats.glitches ||
+        one.stats.aborted_gap != batch.stats.aborted_gap ||
+        one.stats.aborted_count != batch.stats.aborted_count) {
+        printf("FAIL: batched decode disagrees\n");
+        exit(1);
+    }
+
+    // The ring ends with the trace as read, spikes included
+    for (r = auriol_flight_first(fl, fl->h.head), m = 0; r < fl->h.head; r++)
+        m += AURIOL_FLIGHT_TYPE(auriol_flight_get(fl, r)) != AURIOL_FLIGHT_FRAME;
+    for (r = auriol_flight_first(fl, fl->h.head), i = n - m; r < fl->h.head; r++) {
+        rec = auriol_flight_get(fl, r);
+        if (AURIOL_FLIGHT_TYPE(rec) == AURIOL_FLIGHT_FRAME)
+            continue;
+        if (AURIOL_FLIGHT_VALUE(rec) != trace[i++]) {
+            printf("FAIL: recorder lost edges\n");
+            exit(1);
+        }
+    }
+    printf("PASS\n");
+}
@@ -0,0 +1,187 @@
+/*
+   Multi-station dedup: exactly one copy of each reading is published.
+
+   Three stations are compiled in with their main() renamed, sharing a
+   stand-in broker that hands every claim to every station and counts
+   what lands on weather/<station>/raw. Each scenario has some of the
+   stations hear one burst, then lets every dedup window run out.
+
+   The broker first delivers each claim as it is published, then queues
+   them until every station has claimed and delivers them all afterwards,
+   in publish order and reversed, as a real broker's latency would.
+   A last sequence has one station hear a reading change and change back
+   within its window.
+
+   gcc -o dedup-test dedup-test.c -lgpiod -lmosquitto -lrt -lpthread
+*/
+
+#define main station_main
+#include "../auriol-lcd-mqtt.c"
+#undef main
+
+#define STATIONS 3
+#define QUEUED_CLAIMS 16
+
+static struct station stations[STATIONS];
+static struct auriol_shm shm;
+static const char *names[STATIONS] = { "alpha", "bravo", "charlie" };
+static int raw_from[STATIONS];
+
+// Claims held back by the broker, delivery 0 = straight away
+enum { DELIVER_NOW, DELIVER_QUEUED, DELIVER_REVERSED };
+static int delivery;
+static char queued[QUEUED_CLAIMS][2][128];
+static int nqueued;
+
+struct gpiod_line *gpiod_line_bulk_get_line(struct gpiod_line_bulk *bulk,
+                                            unsigned int index) {
+    return NULL;
+}
+
+int gpiod_line_set_value(struct gpiod_line *line, int value) {
+    return 0;
+}
+
+// Claims go to every station straight away, readings are counted
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+                      int payloadlen, const void *payload, int qos, bool retain) {
+    struct mosquitto_message msg;
+    int from = (long)mosq - 1, i;
+
+    if (strncmp(topic, "weather/claim/", 14) == 0 && delivery != DELIVER_NOW) {
+        if (nqueued < QUEUED_CLAIMS) {
+            snprintf(queued[nqueued][0], sizeof(queued[0][0]), "%s", topic);
+            snprintf(queued[nqueued][1], sizeof(queued[0][1]), "%.*s",
+                     payloadlen, (const char *)payload);
+            nqueued++;
+        }
+    } else if (strncmp(topic, "weather/claim/", 14) == 0) {
+        msg.topic = (char *)topic;
+        msg.payload = (void *)payload;
+        msg.payloadlen = payloadlen;
+        for (i = 0; i < STATIONS; i++)
+            cb_message(mosq, &stations[i], &msg);
+    } else if (strstr(topic, "/raw")) {
+        raw_from[from]++;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+// Hand every queued claim to every station
+static void deliver_queued(void) {
+    struct mosquitto_message msg;
+    int i, n, q;
+
+    for (n = 0; n < nqueued; n++) {
+        q = delivery == DELIVER_REVERSED ? nqueued - 1 - n : n;
+        msg.topic = queued[q][0];
+        msg.payload = queued[q][1];
+        msg.payloadlen = strlen(queued[q][1]);
+        for (i = 0; i < STATIONS; i++)
+            cb_message(stations[i].mqtt, &stations[i], &msg);
+    }
+    nqueued = 0;
+}
+
+// Bravo holds F, which alpha claims too, then hears F', F and F' again
+// before its window is out: F goes out once, from alpha, and F' once
+static int sequence(void) {
+    union tempdata f, f2;
+    int64_t ms = 1472000;
+    int total = 0, i, ok;
+
+    memset(raw_from, 0, sizeof(raw_from));
+    f.raw = 0;
+    f.var.sensor = 0x3f;
+    f.var.channel = 0;
+    f.var.celcius = 215;
+    f.var.humidity = 56;
+    f.var.charge = 1;
+    f2 = f;
+    f2.var.celcius = 216;
+
+    dedup_hold(&stations[1], &f, ms);
+    dedup_hold(&stations[0], &f, ms + 80);
+    deliver_queued();
+    dedup_hold(&stations[1], &f2, ms + 300);
+    dedup_hold(&stations[1], &f, ms + 600);
+    dedup_hold(&stations[1], &f2, ms + 900);
+    deliver_queued();
+    for (i = 0; i < STATIONS; i++)
+        dedup_flush(&stations[i], INT64_MAX - 1);
+
+    for (i = 0; i < STATIONS; i++)
+        total += raw_from[i];
+    ok = total == 2 && raw_from[0] == 1 && raw_from[1] == 1;
+    printf("%-28s %d published: %s\n", "queued, F F' F F'", total,
+           ok ? "ok" : "WRONG");
+    return ok;
+}
+
+// Stations in `heard` (a bitmask, in order) decode the frame at sec.ms
+static int scenario(const char *what, int heard, long sec, int expect_from) {
+    struct timespec ts;
+    union tempdata u;
+    int i, total = 0, ok;
+
+    memset(raw_from, 0, sizeof(raw_from));
+    u.raw = 0;
+    u.var.sensor = 0x3f;
+    u.var.channel = 0;
+    u.var.celcius = 215;
+    u.var.humidity = 56;
+    u.var.charge = 1;
+
+    for (i = 0; i < STATIONS; i++) {
+        if (!(heard & 1 << i))
+            continue;
+        // A few repeats apart, as stations catch different frames
+        ts.tv_sec = sec;
+        ts.tv_nsec = i * 80000000L;
+        parseprint(&stations[i], u.raw >> 3, &ts);
+    }
+    deliver_queued();
+    for (i = 0; i < STATIONS; i++)
+        dedup_flush(&stations[i], INT64_MAX - 1);
+
+    for (i = 0; i < STATIONS; i++)
+        total += raw_from[i];
+    ok = total == 1 && raw_from[expect_from] == 1;
+    printf("%-28s %d published, from %s: %s\n", what, total,
+           names[expect_from], ok ? "ok" : "WRONG");
+    return ok;
+}
+
+void main(void) {
+    int i, ok = 1;
+
+    for (i = 0; i < STATIONS; i++) {
+        stations[i].mqtt = (struct mosquitto *)(long)(i + 1);
+        stations[i].shm = &shm;
+        stations[i].dedup_ms = 500;
+        strcpy(stations[i].name, names[i]);
+        stations[i].connected = 1;
+        snprintf(stations[i].rawtopic, sizeof(stations[i].rawtopic),
+                 "weather/%s/raw", names[i]);
+        pthread_mutex_init(&stations[i].claimlock, NULL);
+        decoder_init(&stations[i].dec);
+    }
+
+    ok &= scenario("all three hear it", 7, 1000, 0);
+    ok &= scenario("bravo and charlie", 6, 1059, 1);
+    ok &= scenario("only charlie", 4, 1118, 2);
+    // Same frame again next period, the old claims mustn't swallow it
+    ok &= scenario("all three, unchanged frame", 7, 1177, 0);
+
+    delivery = DELIVER_QUEUED;
+    ok &= scenario("queued, all three", 7, 1236, 0);
+    ok &= scenario("queued, bravo and charlie", 6, 1295, 1);
+    delivery = DELIVER_REVERSED;
+    ok &= scenario("reversed, all three", 7, 1354, 0);
+    ok &= scenario("reversed, bravo and charlie", 6, 1413, 1);
+    delivery = DELIVER_QUEUED;
+    ok &= sequence();
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    exit(!ok);
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../auriol-flight.h"
+
+// gcc -o flight-dump flight-dump.c -lrt
+//
+// ./flight-dump [file]       the station's live ring, or a dump from
+//                            /var/tmp, one line per record with the
+//                            decoder's state replayed alongside
+// ./flight-dump -e [file]    every edge read, glitches included, as
+//                            "sec.nsec" lines that decode-bench and
+//                            glitch-replay read back
+
+static const char *symname[] = { "reset", "0", "1", "sync" };
+
+void main(int argc, char **argv) {
+    struct auriol_flight *fl;
+    uint64_t head, first, after, i, r;
+    uint64_t edges = 0, frames = 0, gaps = 0, counts = 0, glitches = 0;
+    int64_t ts, last = 0, wall;
+    int edges_only = 0, bitcount = 0, type;
+    union tempdata u;
+
+    if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+        edges_only = 1;
+        argc--;
+        argv++;
+    }
+
+    fl = argc > 1 ? auriol_flight_load(argv[1]) : auriol_flight_open();
+    if (!fl) {
+        printf("unable to open %s\n", argc > 1 ? argv[1] : "flight recorder, is the station running?");
+        exit(1);
+    }
+
+    head = __atomic_load_n(&fl->h.head, __ATOMIC_ACQUIRE);
+    first = auriol_flight_first(fl, head);
+
+    for (i = first; i < head; i++) {
+        r = auriol_flight_get(fl, i);
+        type = AURIOL_FLIGHT_TYPE(r);
+
+        if (type == AURIOL_FLIGHT_FRAME) {
+            if (edges_only)
+                continue;
+            u.raw = (AURIOL_FLIGHT_VALUE(r) << 3) & 0xFFFFFFFFFF;
+            printf("    frame %010llx id=%02x,pow=%u,man=%u,ch=%u,temp=%.1f,rh=%u\n",
+                   (unsigned long long)u.raw, u.var.sensor, u.var.charge,
+                   u.var.manual, u.var.channel + 1,
+                   ((float)u.var.celcius / 10), u.var.humidity);
+            frames++;
+            continue;
+        }
+
+        ts = AURIOL_FLIGHT_VALUE(r);
+        wall = auriol_flight_wall(fl, ts);
+        if (type == AURIOL_FLIGHT_DUMP) {
+            if (!edges_only)
+                printf("%lld.%06lld dump requested\n", (long long)(wall / 1000000000),
+                       (long long)(wall % 1000000000 / 1000));
+            continue;
+        }
+
+        if (edges_only) {
+            printf("%lld.%09lld\n", (long long)(ts / 1000000000),
+                   (long long)(ts % 1000000000));
+            continue;
+        }
+
+        // Dropped before the decoder, it never saw this one
+        if (type == AURIOL_FLIGHT_GLITCH) {
+            printf("%lld.%06lld %8lld us glitch, dropped\n",
+                   (long long)(wall / 1000000000),
+                   (long long)(wall % 1000000000 / 1000),
+                   (long long)(last ? (ts - last) / 1000 : 0));
+            glitches++;
+            continue;
+        }
+        edges++;
+
+        // The decoder's view of this edge
+        printf("%lld.%06lld %8lld us %-5s", (long long)(wall / 1000000000),
+               (long long)(wall % 1000000000 / 1000),
+               (long long)(last ? (ts - last) / 1000 : 0), symname[type & 3]);
+        switch (type) {
+        case AURIOL_FLIGHT_ZERO:
+        case AURIOL_FLIGHT_ONE:
+            printf(" bit %d%s\n", bitcount + 1, bitcount ? "" : ", frame start");
+            bitcount++;
+            break;
+        case AURIOL_FLIGHT_SYNC:
+            if (bitcount == 37)
+                printf(" end of frame\n");
+            else if (bitcount) {
+                printf(" reset, sync after %d bits\n", bitcount);
+                counts++;
+            } else
+                printf("\n");
+            bitcount = 0;
+            break;
+        default:
+            if (bitcount) {
+                printf(" reset, gap out of window after %d bits\n", bitcount);
+                gaps++;
+            } else
+                printf("\n");
+            bitcount = 0;
+        }
+        last = ts;
+    }
+
+    // Live, the station may have lapped us while we read
+    after = __atomic_load_n(&fl->h.head, __ATOMIC_ACQUIRE);
+    if (after > first + AURIOL_FLIGHT_RECORDS)
+        fprintf(stderr, "%llu oldest records were overwritten while reading\n",
+                (unsigned long long)(after - first - AURIOL_FLIGHT_RECORDS));
+
+    if (!edges_only)
+        printf("%llu edges, %llu glitches, %llu frames, %llu reset by gap, %llu by sync\n",
+               (unsigned long long)edges, (unsigned long long)glitches,
+               (unsigned long long)frames, (unsigned long long)gaps,
+               (unsigned long long)counts);
+
+    auriol_flight_close(fl);
+    exit(0);
+}
@@ -0,0 +1,161 @@
+/*
+   Glitch filter replay, frames recovered and wakeups taken.
+
+   Replays a capture from libgpiod-detect-rising-edge (its "sec.nsec"
+   lines), or a synthetic trace of bursts with spikes just after some of
+   their edges, through a model of the station's receive loop: each
+   wakeup costs a poll and a read, and reads whatever the kernel queued
+   (16 events at most, libgpiod v1's FIFO) in the time the station took
+   to wake. Three runs:
+
+     none    every edge decoded as it comes
+     filter  glitch_filter() in userspace, as the station does
+     kernel  the same rule applied before the edges are queued, what a
+             kernel-side debounce would save (not reachable with libgpiod v1)
+
+   gcc -O2 -o glitch-replay glitch-replay.c
+   Usage: glitch-replay [glitch ns] [capture]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../auriol-decode.h"
+#include "capture.h"
+
+#define SYNTH_BURSTS 2000
+#define KFIFO 16           // Events the kernel holds per line
+#define WAKE_LATENCY 80000 // Edge to the station reading it, ns
+
+enum { MODE_NONE, MODE_FILTER, MODE_KERNEL };
+
+struct replay {
+    uint64_t wakeups, syscalls, delivered, overflow, frames;
+    struct decoder_stats stats;
+};
+
+// Bursts of six frames, one edge in ten followed by a spike 20-300us
+// later, with quiet stretches and a little RF noise in between
+static int64_t *synthesize(long *n) {
+    int64_t *ts, t = 1000000000LL;
+    uint64_t bits = 0x123456789ULL;
+    long i = 0, size = SYNTH_BURSTS * 6 * 38 * 2 + SYNTH_BURSTS * 40;
+    int burst, r, b;
+
+    ts = malloc(size * sizeof(*ts));
+    if (!ts) {
+        printf("unable to allocate trace\n");
+        exit(1);
+    }
+
+    srand(1);
+    for (burst = 0; burst < SYNTH_BURSTS; burst++) {
+        for (r = 0; r < 6; r++) {
+            for (b = 37; b >= 0; b--) {
+                ts[i++] = t += (b == 0 ? 4500000 : (bits >> (b - 1)) & 1 ? 2500000 : 1500000)
+                               + rand() % 40000 - 20000;
+                if (rand() % 10 == 0)
+                    ts[i++] = t + 20000 + rand() % 280000;
+            }
+        }
+        bits = (bits * 6364136223846793005ULL + 1) & 0x1FFFFFFFFFULL;
+
+        t += 20000000;
+        for (r = 0; r < 20; r++)
+            ts[i++] = t += rand() % 3000000 + 100000;
+        t += 1000000000;
+    }
+
+    *n = i;
+    return ts;
+}
+
+static void replay(const int64_t *trace, long n, long glitch, int mode,
+                   struct replay *out) {
+    struct decoder dec;
+    int64_t queue[KFIFO], stamps[DECODE_BATCH], last = 0, wake;
+    uint64_t frames[DECODE_FRAMES];
+    int at[DECODE_FRAMES];
+    int queued, kept;
+    long i = 0;
+
+    decoder_init(&dec);
+    dec.win.glitch = mode == MODE_NONE ? 0 : glitch;
+    memset(out, 0, sizeof(*out));
+
+    while (i < n) {
+        // Asleep in poll until the next edge is queued
+        if (mode == MODE_KERNEL && trace[i] - last < glitch) {
+            dec.stats.glitches++;
+            i++;
+            continue;
+        }
+        wake = trace[i] + WAKE_LATENCY;
+        out->wakeups++;
+        out->syscalls += 2; // gpiod_line_event_wait() and read_multiple()
+
+        // Everything that arrived before we got to read it
+        queued = 0;
+        for (; i < n && trace[i] <= wake; i++) {
+            if (mode == MODE_KERNEL) {
+                if (trace[i] - last < glitch) {
+                    dec.stats.glitches++;
+                    continue;
+                }
+                last = trace[i];
+            }
+            if (queued == KFIFO) {
+                out->overflow++;
+                continue;
+            }
+            queue[queued++] = trace[i];
+        }
+        out->delivered += queued;
+
+        memcpy(stamps, queue, queued * sizeof(*stamps));
+        kept = mode == MODE_FILTER ? glitch_filter(&dec, stamps, queued, NULL) : queued;
+        out->frames += decode_batch(&dec, stamps, kept, frames, at, NULL);
+    }
+    out->stats = dec.stats;
+}
+
+static void report(const char *name, const struct replay *r) {
+    printf("%-7s %8llu delivered %8llu wakeups %8llu syscalls %6llu lost "
+           "%8llu glitches %6llu frames %6llu aborted\n",
+           name, (unsigned long long)r->delivered,
+           (unsigned long long)r->wakeups, (unsigned long long)r->syscalls,
+           (unsigned long long)r->overflow,
+           (unsigned long long)r->stats.glitches,
+           (unsigned long long)r->frames,
+           (unsigned long long)(r->stats.aborted_gap + r->stats.aborted_count));
+}
+
+void main(int argc, char **argv) {
+    struct decoder dec;
+    struct replay none, filter, kernel;
+    int64_t *trace;
+    long n, glitch;
+
+    decoder_init(&dec);
+    glitch = argc > 1 ? atol(argv[1]) : dec.win.glitch;
+    if (glitch < 0 || glitch >= dec.win.zero_min) {
+        printf("glitch must be between 0 and %ld ns\n", dec.win.zero_min);
+        exit(1);
+    }
+    trace = argc > 2 ? load_capture(argv[2], &n) : synthesize(&n);
+
+    replay(trace, n, glitch, MODE_NONE, &none);
+    replay(trace, n, glitch, MODE_FILTER, &filter);
+    replay(trace, n, glitch, MODE_KERNEL, &kernel);
+
+    printf("%ld edges, glitch minimum %ld ns\n", n, glitch);
+    report("none", &none);
+    report("filter", &filter);
+    report("kernel", &kernel);
+
+    if (filter.frames < none.frames || kernel.frames != filter.frames) {
+        printf("FAIL\n");
+        exit(1);
+    }
+    printf("PASS\n");
+    exit(0);
+}
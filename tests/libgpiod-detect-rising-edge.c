@@ -1,8 +1,24 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <gpiod.h>
 #include <string.h>
+#include "../auriol-decode.h"
 
 // gcc -o gpiod-detect-rising gpiod-detect-rising.c -lgpiod
+//
+// ./gpiod-detect-rising               print every edge
+// ./gpiod-detect-rising -c [secs] [file]
+//     calibrate: histogram the gaps for a while (default 240s, enough for
+//     every channel to send a few times), find the 0, 1 and sync peaks
+//     and write the decoder's pulse windows (default PULSE_CONF)
+
+#define HIST_BIN 10000   // 10 usec per bin
+#define HIST_BINS 800    // Up to 8 msecs, longer gaps land in the last bin
+#define PEAK_MIN 20      // Edges a peak needs before it's believed
+#define PEAK_SPREAD 30   // Bins a window reaches either side of its peak, at most
+
+static unsigned long hist[HIST_BINS + 1];
+
 static inline void timediff(struct timespec *old, struct timespec *new,
                             struct timespec *diff)
 {
@@ -14,7 +30,123 @@ static inline void timediff(struct timespec *old, struct timespec *new,
     }
 }
 
-void main(void)
+static inline unsigned long smoothed(int i)
+{
+    if (i <= 0 || i >= HIST_BINS - 1)
+        return hist[i] * 3;
+    return hist[i - 1] + hist[i] + hist[i + 1];
+}
+
+// Find the peak between from and to (nsecs) and how far it spreads
+int find_peak(const char *name, long from, long to, long *min, long *max)
+{
+    int i, lo, hi, peak = from / HIST_BIN, first = from / HIST_BIN;
+    int last = to / HIST_BIN - 1;
+    unsigned long floor, noise = smoothed(first);
+
+    for (i = first; i <= last; i++) {
+        if (smoothed(i) > smoothed(peak))
+            peak = i;
+        if (smoothed(i) < noise)
+            noise = smoothed(i);
+    }
+
+    if (smoothed(peak) < PEAK_MIN * 3) {
+        printf("%-4s no peak between %ld and %ld nsecs\n", name, from, to);
+        return -1;
+    }
+
+    // Widen until the count drops to 5% of the peak above the RF noise,
+    // or stops falling, plus one bin of slack. Noise that never drops
+    // that low would otherwise take the whole range.
+    floor = noise + (smoothed(peak) - noise) / 20;
+    for (lo = peak; lo > first && lo > peak - PEAK_SPREAD &&
+                    smoothed(lo - 1) > floor && smoothed(lo - 1) <= smoothed(lo); lo--)
+        ;
+    for (hi = peak; hi < last && hi < peak + PEAK_SPREAD &&
+                    smoothed(hi + 1) > floor && smoothed(hi + 1) <= smoothed(hi); hi++)
+        ;
+    *min = (lo - 1) * (long)HIST_BIN;
+    *max = (hi + 2) * (long)HIST_BIN;
+
+    printf("%-4s peak %ld nsecs (%lu edges), window %ld - %ld\n",
+           name, peak * (long)HIST_BIN + HIST_BIN / 2, hist[peak], *min, *max);
+    return 0;
+}
+
+int calibrate(struct gpiod_line *line, int secs, const char *path)
+{
+    struct timespec timeout = { 1, 0 };
+    struct timespec start, now, last_time = { 0, 0 }, gap_time;
+    struct gpiod_line_event events[64];
+    struct pulse_windows w;
+    unsigned long edges = 0;
+    long bin;
+    int ret, i;
+    FILE *f;
+
+    printf("calibrating for %d secs...\n", secs);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        ret = gpiod_line_event_wait(line, &timeout);
+        if (ret < 0) {
+            printf("error waiting");
+            return -1;
+        }
+        if (ret > 0) {
+            ret = gpiod_line_event_read_multiple(line, events,
+                                       (sizeof(events) / sizeof(*(events))));
+            if (ret < 0) {
+                printf("error reading event");
+                return -1;
+            }
+
+            // Only count, printing here is what used to drop edges
+            for (i = 0; i < ret; i++) {
+                timediff(&last_time, &events[i].ts, &gap_time);
+                last_time = events[i].ts;
+                bin = gap_time.tv_sec ? HIST_BINS : gap_time.tv_nsec / HIST_BIN;
+                hist[bin < HIST_BINS ? bin : HIST_BINS]++;
+            }
+            edges += ret;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < secs);
+
+    printf("%lu edges, %lu gaps over %d msecs\n",
+           edges, hist[HIST_BINS], HIST_BINS * HIST_BIN / 1000000);
+
+    // Look for each symbol either side of its nominal 1.5/2.5/4.5 msecs
+    if (find_peak("zero", 1000000, 2000000, &w.zero_min, &w.zero_max) ||
+        find_peak("one", 2000000, 3500000, &w.one_min, &w.one_max) ||
+        find_peak("sync", 3500000, 6000000, &w.sync_min, &w.sync_max)) {
+        printf("not enough transmissions heard, nothing written\n");
+        return -1;
+    }
+
+    // Windows mustn't overlap, split the difference if they do
+    if (w.zero_max > w.one_min)
+        w.zero_max = w.one_min = (w.zero_max + w.one_min) / 2;
+    if (w.one_max > w.sync_min)
+        w.one_max = w.sync_min = (w.one_max + w.sync_min) / 2;
+
+    f = fopen(path, "w");
+    if (!f) {
+        printf("unable to write %s\n", path);
+        return -1;
+    }
+    fprintf(f, "# Pulse windows (nsecs, from inclusive, to exclusive)\n");
+    fprintf(f, "# %lu edges over %d secs\n", edges, secs);
+    fprintf(f, "zero %ld %ld\n", w.zero_min, w.zero_max);
+    fprintf(f, "one %ld %ld\n", w.one_min, w.one_max);
+    fprintf(f, "sync %ld %ld\n", w.sync_min, w.sync_max);
+    fclose(f);
+
+    printf("written to %s\n", path);
+    return 0;
+}
+
+void main(int argc, char **argv)
 {
     struct timespec timeout = { 10, 0 };
     struct timespec last_time, gap_time;
@@ -39,6 +171,14 @@ void main(void)
     ret = gpiod_line_request(line, &config, 0);
     if (ret)
         printf("unable to request line for events");
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        ret = calibrate(line, argc > 2 ? atoi(argv[2]) : 240,
+                        argc > 3 ? argv[3] : PULSE_CONF);
+        gpiod_line_release(line);
+        gpiod_chip_close(chip);
+        exit(ret ? 1 : 0);
+    }
 	
     for(;;) {
         memset(line, 0, sizeof(struct gpiod_line *));
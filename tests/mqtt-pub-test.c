@@ -1,61 +1,411 @@
+/*
+   MQTT load generator, many simulated stations publishing readings.
+
+   Each station has 1-3 channels and publishes what auriol-lcd-mqtt would,
+   a "time ms: raw" var_s frame on weather/<station>/raw, every 59, 69 or 79
+   seconds depending on the channel. A speedup above 1 compresses that
+   schedule to load the broker harder. Stations are spread over several
+   client connections, one thread each.
+
+   Every interval it reports the publish rate, ack latency percentiles
+   (PUBACK/PUBCOMP for QoS 1/2, socket write for QoS 0), messages still in
+   flight on our side, the broker's stored message count from $SYS and how
+   many acked messages a subscriber has not yet been sent.
+
+   gcc -O2 -o mqtt-pub-test mqtt-pub-test.c -lmosquitto -lpthread
+   Usage: mqtt-pub-test [stations] [connections] [qos] [speedup] [seconds] [host]
+*/
+
 #include <mosquitto.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "../auriol-decode.h"
+
+#define REPORT_INTERVAL 5
+#define LAT_BUCKETS (40 * 8)   // log2 with 8 steps per power of two, in us
+#define MIDS 65536             // Message ids are 16-bit
+
+struct channel {
+    int64_t due;               // Monotonic ns of the next reading
+    int64_t period;
+    union tempdata u;
+    int station;
+};
+
+struct latency {
+    uint64_t count[LAT_BUCKETS];
+};
+
+struct conn {
+    struct mosquitto *mqtt;
+    pthread_t thread;
+    pthread_mutex_t lock;      // Held across publish so acks find their send time
+    int64_t sent[MIDS];
+    struct channel *heap;      // Min-heap on due
+    int nheap;
+    char (*topics)[64];        // Indexed by station
+    uint64_t published, acked, failed;
+    struct latency lat;
+};
+
+static struct {
+    const char *host;
+    int port, qos, stations, conns, seconds;
+    double speedup;
+    volatile int stop;
+    struct conn *conn;
+    uint64_t stored;           // $SYS/broker/store/messages/count
+    uint64_t received;         // Our own readings delivered back to us
+} load;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+static int lat_bucket(uint64_t us) {
+    int msb;
+
+    if (us < 8)
+        return us;
+    msb = 63 - __builtin_clzll(us);
+    if (msb >= LAT_BUCKETS / 8)
+        return LAT_BUCKETS - 1;
+    return msb * 8 + (us >> (msb - 3) & 7);
+}
+
+// Lower bound of a bucket, in microseconds
+static uint64_t lat_value(int bucket) {
+    if (bucket < 8)
+        return bucket;
+    return (uint64_t)(8 + (bucket & 7)) << (bucket / 8 - 3);
+}
+
+static uint64_t lat_percentile(const struct latency *l, uint64_t total, double p) {
+    uint64_t want = total * p, seen = 0;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += l->count[i];
+        if (seen > want)
+            return lat_value(i);
+    }
+    return lat_value(LAT_BUCKETS - 1);
+}
+
+static void heap_push(struct conn *c, struct channel *ch) {
+    int i = c->nheap++, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (c->heap[parent].due <= ch->due)
+            break;
+        c->heap[i] = c->heap[parent];
+        i = parent;
+    }
+    c->heap[i] = *ch;
+}
+
+// Push the root back after moving its due time on
+static void heap_sift(struct conn *c) {
+    struct channel top = c->heap[0];
+    int i = 0, child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= c->nheap)
+            break;
+        if (child + 1 < c->nheap && c->heap[child + 1].due < c->heap[child].due)
+            child++;
+        if (top.due <= c->heap[child].due)
+            break;
+        c->heap[i] = c->heap[child];
+        i = child;
+    }
+    c->heap[i] = top;
+}
 
 void cb_connect(struct mosquitto *mqtt, void *obj, int code) {
-	printf("Connection status: %s\n", mosquitto_connack_string(code));
-	if (code)
-		mosquitto_disconnect(mqtt);
+    if (code) {
+        fprintf(stderr, "Connection status: %s\n", mosquitto_connack_string(code));
+        mosquitto_disconnect(mqtt);
+    }
 }
 
 void cb_publish(struct mosquitto *mqtt, void *obj, int msg_id) {
- 	printf("Message sent as: %u\n", msg_id);
-}	
-
-void main(void) {
-	struct mosquitto *mqtt;
-	int ret;
-	char msg[] = "12345678";
-	char top[] = "weather/raw";
-
-	char host[] = "localhost";
-	int port = 1883;
-	int timeout = 60;
-
-	mosquitto_lib_init();
-	mqtt = mosquitto_new(NULL, true, NULL);
-	if(mqtt == NULL) {
-		fprintf(stderr, "Error initialising MQTT\n");
-		exit(1);
-	}
-
-	mosquitto_connect_callback_set(mqtt, cb_connect);
-	mosquitto_publish_callback_set(mqtt, cb_publish);
-
-	ret = mosquitto_connect(mqtt, host, port, timeout);
-
-	if (ret != MOSQ_ERR_SUCCESS) {
-		mosquitto_destroy(mqtt);
-		fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
-		exit(2);
-	}
-
-	ret = mosquitto_loop_start(mqtt);
-	if (ret != MOSQ_ERR_SUCCESS) {
-		mosquitto_destroy(mqtt);
-		fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
-		exit(2);
-	}
-
-	for(;;) {
-		ret = mosquitto_publish(mqtt, NULL, top, strlen(msg), msg, 2, false);
-		if (ret != MOSQ_ERR_SUCCESS) {
-			mosquitto_destroy(mqtt);
-			fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
-			exit(3);
-		}
-		sleep(10);
-	}
+    struct conn *c = obj;
+    int64_t us;
+
+    pthread_mutex_lock(&c->lock);
+    us = (now_ns() - c->sent[msg_id & (MIDS - 1)]) / 1000;
+    pthread_mutex_unlock(&c->lock);
+
+    __atomic_add_fetch(&c->lat.count[lat_bucket(us < 0 ? 0 : us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->acked, 1, __ATOMIC_RELAXED);
+}
+
+// The monitor connection, subscribed to $SYS and to our own readings
+void cb_monitor_connect(struct mosquitto *mqtt, void *obj, int code) {
+    if (code) {
+        fprintf(stderr, "Monitor connection status: %s\n", mosquitto_connack_string(code));
+        return;
+    }
+    mosquitto_subscribe(mqtt, NULL, "$SYS/broker/store/messages/count", 0);
+    mosquitto_subscribe(mqtt, NULL, "weather/+/raw", 0);
+}
+
+void cb_monitor_message(struct mosquitto *mqtt, void *obj,
+                        const struct mosquitto_message *msg) {
+    char buf[32];
+    int len;
+
+    if (strncmp(msg->topic, "$SYS/", 5) == 0) {
+        len = msg->payloadlen < 31 ? msg->payloadlen : 31;
+        memcpy(buf, msg->payload, len);
+        buf[len] = 0;
+        __atomic_store_n(&load.stored, strtoull(buf, NULL, 10), __ATOMIC_RELAXED);
+    } else if (strncmp(msg->topic, "weather/load", 12) == 0) {
+        __atomic_add_fetch(&load.received, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static struct mosquitto *client(void *obj) {
+    struct mosquitto *mqtt;
+    int ret;
+
+    mqtt = mosquitto_new(NULL, true, obj);
+    if (mqtt == NULL) {
+        fprintf(stderr, "Error initialising MQTT\n");
+        exit(1);
+    }
+
+    ret = mosquitto_connect(mqtt, load.host, load.port, 60);
+    if (ret != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "Couldn't connect: %s\n", mosquitto_strerror(ret));
+        exit(2);
+    }
+    return mqtt;
+}
+
+// One reading on, the way a sensor on a windowsill wanders
+static void reading_step(union tempdata *u) {
+    int t = u->var.celcius + rand() % 5 - 2;
+    int h = u->var.humidity + rand() % 3 - 1;
+
+    u->var.celcius = t < -300 ? -300 : t > 500 ? 500 : t;
+    u->var.humidity = h < 10 ? 10 : h > 99 ? 99 : h;
+}
+
+static void *publisher(void *arg) {
+    struct conn *c = arg;
+    struct channel *ch;
+    struct timespec wait;
+    struct timespec wall;
+    char msg[33];
+    int64_t now;
+    int mid, ret;
+
+    while (!load.stop) {
+        ch = &c->heap[0];
+        now = now_ns();
+        if (ch->due > now) {
+            // Sleep in short steps so stop is noticed
+            wait.tv_sec = 0;
+            wait.tv_nsec = ch->due - now < 100000000 ? ch->due - now : 100000000;
+            nanosleep(&wait, NULL);
+            continue;
+        }
+
+        reading_step(&ch->u);
+        clock_gettime(CLOCK_REALTIME, &wall);
+        sprintf(msg, "%lld: %llu", (long long)(timespec_ns(&wall) / 1000000),
+                (unsigned long long)ch->u.raw);
+
+        pthread_mutex_lock(&c->lock);
+        ret = mosquitto_publish(c->mqtt, &mid, c->topics[ch->station],
+                                strlen(msg), msg, load.qos, false);
+        if (ret == MOSQ_ERR_SUCCESS) {
+            c->sent[mid & (MIDS - 1)] = now_ns();
+            __atomic_add_fetch(&c->published, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&c->failed, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        ch->due += ch->period;
+        heap_sift(c);
+    }
+    return NULL;
+}
+
+static void setup(void) {
+    struct channel ch;
+    struct conn *c;
+    int s, i, n;
+
+    load.conn = calloc(load.conns, sizeof(*load.conn));
+    if (!load.conn) {
+        fprintf(stderr, "Unable to allocate %d connections\n", load.conns);
+        exit(1);
+    }
+
+    for (i = 0; i < load.conns; i++) {
+        c = &load.conn[i];
+        pthread_mutex_init(&c->lock, NULL);
+        c->heap = calloc(3 * (load.stations / load.conns + 1), sizeof(*c->heap));
+        c->topics = calloc(load.stations, sizeof(*c->topics));
+        if (!c->heap || !c->topics) {
+            fprintf(stderr, "Unable to allocate %d stations\n", load.stations);
+            exit(1);
+        }
+    }
+
+    // Station s goes on connection s % conns, channels start at random
+    // points in their period so the load is spread out
+    for (s = 0; s < load.stations; s++) {
+        c = &load.conn[s % load.conns];
+        snprintf(c->topics[s], sizeof(c->topics[s]), "weather/load%05d/raw", s);
+        n = 1 + rand() % 3;
+        for (i = 0; i < n; i++) {
+            memset(&ch, 0, sizeof(ch));
+            ch.station = s;
+            ch.u.var.sensor = rand() & 0xff;
+            ch.u.var.channel = i;
+            ch.u.var.charge = 1;
+            ch.u.var.celcius = 100 + rand() % 150;
+            ch.u.var.humidity = 30 + rand() % 50;
+            ch.period = ((i + 1) * 10 + 49) * 1000000000LL / load.speedup;
+            ch.due = now_ns() + (int64_t)(rand() / (RAND_MAX + 1.0) * ch.period);
+            heap_push(c, &ch);
+        }
+    }
+}
+
+struct totals {
+    uint64_t published, acked, failed, lat_total;
+    struct latency lat;
+};
+
+static void collect(struct totals *t) {
+    struct conn *c;
+    int i, b;
+
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < load.conns; i++) {
+        c = &load.conn[i];
+        t->published += __atomic_load_n(&c->published, __ATOMIC_RELAXED);
+        t->acked += __atomic_load_n(&c->acked, __ATOMIC_RELAXED);
+        t->failed += __atomic_load_n(&c->failed, __ATOMIC_RELAXED);
+        for (b = 0; b < LAT_BUCKETS; b++)
+            t->lat.count[b] += __atomic_load_n(&c->lat.count[b], __ATOMIC_RELAXED);
+    }
+}
+
+static void report(const char *label, const struct totals *now,
+                   const struct totals *prev, double secs) {
+    struct latency lat;
+    uint64_t acked = now->acked - prev->acked, received;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+        lat.count[b] = now->lat.count[b] - prev->lat.count[b];
+    received = __atomic_load_n(&load.received, __ATOMIC_RELAXED);
+
+    printf("%-6s %8.1f pub/s %8.1f ack/s  ack p50 %6llu p90 %6llu p99 %6llu us"
+           "  inflight %6llu  stored %6llu  undelivered %6lld  failed %llu\n",
+           label, (now->published - prev->published) / secs, acked / secs,
+           (unsigned long long)lat_percentile(&lat, acked, 0.50),
+           (unsigned long long)lat_percentile(&lat, acked, 0.90),
+           (unsigned long long)lat_percentile(&lat, acked, 0.99),
+           (unsigned long long)(now->published - now->acked),
+           (unsigned long long)__atomic_load_n(&load.stored, __ATOMIC_RELAXED),
+           (long long)(now->acked - received),
+           (unsigned long long)now->failed);
+    fflush(stdout);
+}
+
+void main(int argc, char **argv) {
+    struct mosquitto *monitor;
+    struct totals start, prev, now;
+    int64_t begin;
+    int i, ret;
+
+    load.stations = argc > 1 ? atoi(argv[1]) : 100;
+    load.conns = argc > 2 ? atoi(argv[2]) : 4;
+    load.qos = argc > 3 ? atoi(argv[3]) : 2;
+    load.speedup = argc > 4 ? atof(argv[4]) : 1;
+    load.seconds = argc > 5 ? atoi(argv[5]) : 60;
+    load.host = argc > 6 ? argv[6] : "localhost";
+    load.port = 1883;
+
+    if (load.stations < 1 || load.conns < 1 || load.qos < 0 || load.qos > 2 ||
+        load.speedup <= 0 || load.seconds < 1) {
+        fprintf(stderr, "Usage: %s [stations] [connections] [qos] [speedup] [seconds] [host]\n",
+                argv[0]);
+        exit(1);
+    }
+    if (load.conns > load.stations)
+        load.conns = load.stations;
+
+    srand(getpid());
+    mosquitto_lib_init();
+    setup();
+
+    monitor = client(NULL);
+    mosquitto_connect_callback_set(monitor, cb_monitor_connect);
+    mosquitto_message_callback_set(monitor, cb_monitor_message);
+    mosquitto_loop_start(monitor);
+
+    for (i = 0; i < load.conns; i++) {
+        load.conn[i].mqtt = client(&load.conn[i]);
+        mosquitto_connect_callback_set(load.conn[i].mqtt, cb_connect);
+        mosquitto_publish_callback_set(load.conn[i].mqtt, cb_publish);
+        ret = mosquitto_loop_start(load.conn[i].mqtt);
+        if (ret != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "Couldn't start network thread: %s\n", mosquitto_strerror(ret));
+            exit(2);
+        }
+    }
+
+    printf("%d stations on %d connections, QoS %d, %.1fx speed, %.1f readings/sec expected\n",
+           load.stations, load.conns, load.qos, load.speedup,
+           load.stations * (1 / 59.0 + 2 / 69.0 / 3 + 1 / 79.0 / 3) * load.speedup);
+
+    for (i = 0; i < load.conns; i++)
+        pthread_create(&load.conn[i].thread, NULL, publisher, &load.conn[i]);
+
+    begin = now_ns();
+    collect(&start);
+    prev = start;
+    while (now_ns() - begin < load.seconds * 1000000000LL) {
+        sleep(REPORT_INTERVAL);
+        collect(&now);
+        report("", &now, &prev, REPORT_INTERVAL);
+        prev = now;
+    }
+
+    load.stop = 1;
+    for (i = 0; i < load.conns; i++)
+        pthread_join(load.conn[i].thread, NULL);
+
+    // Give outstanding acks a moment before the summary
+    sleep(1);
+    collect(&now);
+    report("total", &now, &start, (now_ns() - begin) / 1e9);
+
+    for (i = 0; i < load.conns; i++) {
+        mosquitto_disconnect(load.conn[i].mqtt);
+        mosquitto_loop_stop(load.conn[i].mqtt, false);
+        mosquitto_destroy(load.conn[i].mqtt);
+    }
+    mosquitto_disconnect(monitor);
+    mosquitto_loop_stop(monitor, false);
+    mosquitto_destroy(monitor);
+    mosquitto_lib_cleanup();
+    exit(0);
 }
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <time.h>
+#include "../auriol-shm.h"
+
+// gcc -o shm-reader-test shm-reader-test.c -lrt
+void main(void) {
+    struct auriol_shm *shm;
+    struct auriol_shm_entry entry;
+    struct timespec timeout = { 80, 0 };
+    uint32_t gen;
+    int sensor, channel;
+
+    shm = auriol_shm_open();
+    if (!shm) {
+        printf("unable to open shared memory, is the station running?\n");
+        return;
+    }
+
+    gen = auriol_shm_generation(shm);
+    for(;;) {
+        auriol_shm_wait(shm, gen, &timeout);
+        gen = auriol_shm_generation(shm);
+
+        printf("generation %u\n", gen);
+        for (channel = 0; channel < AURIOL_SHM_CHANNELS; channel++) {
+            for (sensor = 0; sensor < AURIOL_SHM_SENSORS; sensor++) {
+                if (!auriol_shm_read(shm, sensor, channel, &entry))
+                    continue;
+                printf("  %lld: id=%02x,pow=%u,man=%u,ch=%u,temp=%.1f,rh=%u\n",
+                       (long long)entry.time_ms, entry.sensor, entry.charge,
+                       entry.manual, entry.channel + 1,
+                       ((float)entry.celcius / 10), entry.humidity);
+            }
+        }
+    }
+
+    auriol_shm_close(shm);
+}